@@ -20,18 +20,31 @@
 #include <linux/clk.h>
 #include <linux/clk-provider.h>
 #include <linux/clkdev.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
+#include <linux/firmware.h>
 #include <linux/gpio/consumer.h>
+#include <linux/hashtable.h>
 #include <linux/i2c.h>
+#include <linux/interrupt.h>
 #include <linux/module.h>
 #include <linux/pm_runtime.h>
+#include <linux/regmap.h>
 #include <linux/regulator/consumer.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/workqueue.h>
 #include <media/v4l2-ctrls.h>
 #include <media/v4l2-device.h>
 #include <media/v4l2-fwnode.h>
 #include <media/v4l2-mediabus.h>
 #include <asm/unaligned.h>
 
+#define CREATE_TRACE_POINTS
+#include "arducam_trace.h"
+
 #define arducam_REG_VALUE_08BIT		1
 #define arducam_REG_VALUE_16BIT		2
 #define arducam_REG_VALUE_32BIT		4
@@ -85,7 +98,10 @@
 #define arducam_TEST_PATTERN_GREY_COLOR	3
 #define arducam_TEST_PATTERN_PN9		4
 
-/* Embedded metadata stream structure */
+/*
+ * Embedded metadata stream structure, for firmware that does not report
+ * one through METADATA_WIDTH_REG
+ */
 #define ARDUCAM_EMBEDDED_LINE_WIDTH 16384
 #define ARDUCAM_NUM_EMBEDDED_LINES 1
 
@@ -99,6 +115,26 @@ enum pad_types {
 static int debug = 0;
 module_param(debug, int, 0644);
 
+static bool desc_cache = true;
+module_param(desc_cache, bool, 0644);
+MODULE_PARM_DESC(desc_cache, "Load enumerated descriptors from firmware cache");
+
+static bool async_ctrl = true;
+module_param(async_ctrl, bool, 0644);
+MODULE_PARM_DESC(async_ctrl, "Queue control writes while streaming");
+
+
+static int autosuspend_delay_ms = 2000;
+module_param(autosuspend_delay_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_delay_ms, "Initial runtime PM autosuspend delay, see power/autosuspend_delay_ms");
+
+/* Descriptor cache file, keyed by SENSOR_ID_REG and DEVICE_VERSION_REG */
+#define ARDUCAM_DESC_FW_NAME	"arducam/pivariety-%08x-%08x.bin"
+#define ARDUCAM_DESC_MAX_FORMATS	64
+#define ARDUCAM_DESC_MAX_RESOLUTIONS	256
+#define ARDUCAM_DESC_MAX_CTRLS		256
+#define ARDUCAM_DESC_MAX_WORDS		(16 * DESC_WINDOW_WORDS)
+
 struct arducam_reg {
 	u16 address;
 	u8 val;
@@ -202,36 +238,18 @@ static const char * const arducam_supply_name[] = {
 	"VDDL",  /* IF (1.2V) supply */
 };
 
+#define arducam_NUM_SUPPLIES ARRAY_SIZE(arducam_supply_name)
+
 /*
- * The supported formats.
- * This table MUST contain 4 entries per format, to cover the various flip
- * combinations in the order
- * - no flip
- * - h flip
- * - v flip
- * - h&v flips
+ * wait_for_free() timing. Without a ready interrupt, SYSTEM_IDLE_REG is
+ * polled with a backoff starting at ARDUCAM_IDLE_POLL_MIN_US and doubling
+ * up to the caller's interval.
  */
-static const u32 codes[] = {
-	MEDIA_BUS_FMT_SBGGR8_1X8,
-	MEDIA_BUS_FMT_SGBRG8_1X8,
-	MEDIA_BUS_FMT_SGRBG8_1X8,
-	MEDIA_BUS_FMT_SRGGB8_1X8,
-	MEDIA_BUS_FMT_Y8_1X8,
-
-	MEDIA_BUS_FMT_SBGGR10_1X10,
-	MEDIA_BUS_FMT_SGBRG10_1X10,
-	MEDIA_BUS_FMT_SGRBG10_1X10,
-	MEDIA_BUS_FMT_SRGGB10_1X10,
-	MEDIA_BUS_FMT_Y10_1X10,
-
-	MEDIA_BUS_FMT_SBGGR12_1X12,
-	MEDIA_BUS_FMT_SGBRG12_1X12,
-	MEDIA_BUS_FMT_SGRBG12_1X12,
-	MEDIA_BUS_FMT_SRGGB12_1X12,
-	MEDIA_BUS_FMT_Y12_1X12,
-};
+#define ARDUCAM_IDLE_TIMEOUT_MS		1000
+#define ARDUCAM_IDLE_POLL_MIN_US	50
 
-#define arducam_NUM_SUPPLIES ARRAY_SIZE(arducam_supply_name)
+/* Frame-sync controls committed by one grouped hold */
+#define ARDUCAM_CTRL_HOLD_MAX		8
 
 #define arducam_XCLR_DELAY_MS 10	/* Initialisation delay after XCLR low->high */
 #define arducam_XCLR_MIN_DELAY_US	6200
@@ -250,6 +268,183 @@ static const struct arducam_mode supported_modes[] = {
 	},
 };
 
+enum arducam_probe_phase {
+	PROBE_PHASE_POWER,
+	PROBE_PHASE_IDENTIFY,
+	PROBE_PHASE_DESCRIPTORS,
+	PROBE_PHASE_CONTROLS,
+	PROBE_PHASE_REGISTER,
+	NUM_PROBE_PHASES
+};
+
+struct arducam_ctrl_cmd {
+	struct list_head list;
+	u32 id;
+	s32 val;
+};
+
+/* Measured wait_for_free() durations */
+struct arducam_wait_stats {
+	u32 count;
+	u32 timeouts;
+	u32 polls;
+	u32 last_us;
+	u32 max_us;
+	u64 total_us;
+};
+
+/*
+ * Lookup tables over supported_formats, so that format negotiation does
+ * not scan the format and resolution lists on every call.
+ */
+#define ARDUCAM_CODE_HASH_BITS	6
+#define ARDUCAM_RES_HASH_BITS	8
+#define ARDUCAM_CTRL_HASH_BITS	6
+
+/* Media bus code to format index */
+struct arducam_code_entry {
+	struct hlist_node node;
+	u32 code;
+	int format_idx;
+	/* false for the other bayer orders of a raw format */
+	bool exact;
+};
+
+/* (format index, width, height) to resolution index */
+struct arducam_res_entry {
+	struct hlist_node node;
+	u32 width;
+	u32 height;
+	int format_idx;
+	int resolution_idx;
+};
+
+/* log2 latency histogram: bucket n counts durations below 2^n us */
+#define ARDUCAM_HIST_BUCKETS	24
+
+struct arducam_hist {
+	u32 bucket[ARDUCAM_HIST_BUCKETS];
+};
+
+/* Bridge register blocks, indexed by register address >> 8 */
+#define ARDUCAM_REG_BLOCKS	((DESC_WINDOW_BASE >> 8) + 1)
+
+/* I2C transfers on one register block, cache hits excluded */
+struct arducam_xfer_stats {
+	u32 reads;
+	u32 writes;
+	u32 regs;
+	u32 retries;
+	u32 failures;
+	struct arducam_hist hist;
+};
+
+/* s_ctrl latency of one control descriptor */
+struct arducam_ctrl_stats {
+	u32 count;
+	u32 max_us;
+	u64 total_us;
+};
+
+/*
+ * Control registry: one entry per bridge control descriptor, hashed by
+ * control id. Built once the controls have been created.
+ */
+struct arducam_ctrl_entry {
+	struct hlist_node node;
+	u32 id;
+	struct v4l2_ctrl *ctrl;
+	/* enum arducam_ctrl_latency: how long the bridge is busy after a write */
+	u8 latency_class;
+	/* Auto mode that lets the bridge change the value itself, or NULL */
+	struct v4l2_ctrl *auto_ctrl;
+	/*
+	 * Last value the bridge acknowledged, valid until the bridge is
+	 * reset or the mode changes.
+	 */
+	bool written;
+	s32 last;
+	/* Protected by stats_lock */
+	struct arducam_ctrl_stats stats;
+};
+
+/* Subdev operations whose bridge traffic and time are accounted */
+enum arducam_op {
+	ARDUCAM_OP_ENUM_MBUS_CODE,
+	ARDUCAM_OP_GET_FMT,
+	ARDUCAM_OP_SET_FMT,
+	ARDUCAM_OP_ENUM_FRAME_SIZE,
+	ARDUCAM_OP_GET_SELECTION,
+	ARDUCAM_OP_SET_SELECTION,
+	ARDUCAM_OP_ENUM_FRAME_INTERVAL,
+	ARDUCAM_OP_S_STREAM,
+	ARDUCAM_OP_S_CTRL,
+	NUM_ARDUCAM_OPS
+};
+
+struct arducam_op_stats {
+	u32 calls;
+	u64 xfers;
+	u64 regs;
+	u64 total_ns;
+	u64 wait_ns;
+	u64 max_ns;
+};
+
+/* Running totals an operation's share is taken from */
+struct arducam_op_ctx {
+	ktime_t start;
+	u64 xfers;
+	u64 regs;
+	u64 wait_ns;
+};
+
+struct arducam_stats {
+	/* Totals since the last reset, see arducam_op_begin() */
+	u64 xfers;
+	u64 regs;
+	u64 wait_ns;
+	struct arducam_op_stats op[NUM_ARDUCAM_OPS];
+	struct arducam_xfer_stats xfer[ARDUCAM_REG_BLOCKS];
+	struct arducam_hist wait_hist;
+	struct arducam_hist ctrl_hist;
+	struct arducam_hist stream_on_hist;
+	struct arducam_hist stream_off_hist;
+};
+
+/*
+ * Sync group: cameras sharing an external trigger. Slaves run in trigger
+ * mode (V4L2_CID_ARDUCAM_EXT_TRI) from their own STREAMON; STREAMON on the
+ * master is refused with -EAGAIN until every slave is streaming, so all
+ * members expose on the same frame edge. Groups and membership are
+ * protected by arducam_sync_lock, which nests outside each member's mutex.
+ */
+enum arducam_sync_role {
+	ARDUCAM_SYNC_NONE,
+	ARDUCAM_SYNC_MASTER,
+	ARDUCAM_SYNC_SLAVE,
+};
+
+struct arducam_sync_group {
+	struct list_head list;
+	struct list_head members;
+	u32 id;
+	bool has_master;
+};
+
+/*
+ * Bridge state snapshot, as the register writes that recreate it after a
+ * reset: the mode and readout window first, then the controls that are
+ * not at their default as (CTRL_ID, CTRL_VALUE) pairs.
+ */
+#define ARDUCAM_SNAPSHOT_MODE_REGS	7
+
+struct arducam_snapshot {
+	struct reg_sequence *seq;
+	int num_mode;
+	int num_seq;
+};
+
 struct arducam {
 	struct v4l2_subdev sd;
 	struct media_pad pad[NUM_PADS];
@@ -258,12 +453,53 @@ struct arducam {
 	struct clk *xclk; /* system clock to arducam */
 	u32 xclk_freq;
 	struct gpio_desc *reset_gpio;
+	struct regmap *regmap;
+	/* Serializes register access; the cache mode is toggled per block */
+	struct mutex reg_lock;
+	/* Last IPC_SEL_TARGET_REG value, the IPC window depends on it */
+	u32 sel_target;
+	/* Optional bridge ready line, signalled when SYSTEM_IDLE_REG clears */
+	struct gpio_desc *ready_gpio;
+	int ready_irq;
+	struct completion idle_done;
+	/* Statistics, exported through debugfs; protected by stats_lock */
+	spinlock_t stats_lock;
+	struct arducam_wait_stats wait_stats;
+	struct arducam_stats stats;
+	struct dentry *debugfs;
+	u32 probe_us[NUM_PROBE_PHASES];
     struct i2c_client *client;
+	u32 sensor_id;
+	u32 firmware_version;
 	struct arducam_format *supported_formats;
 	int num_supported_formats;
+	/* See arducam_build_lookup(); code_table follows the flips */
+	DECLARE_HASHTABLE(code_table, ARDUCAM_CODE_HASH_BITS);
+	DECLARE_HASHTABLE(res_table, ARDUCAM_RES_HASH_BITS);
+	struct arducam_code_entry *code_entries;
+	struct arducam_res_entry *res_entries;
+	struct arducam_ctrl_desc *ctrl_descs;
+	int num_ctrl_descs;
+	/* See struct arducam_ctrl_entry, in ctrl_descs order */
+	struct arducam_ctrl_entry *ctrl_entries;
+	DECLARE_HASHTABLE(ctrl_table, ARDUCAM_CTRL_HASH_BITS);
+	/* Serialized descriptors, exported through sysfs */
+	__le32 *desc_blob;
+	size_t desc_words;
 	int current_format_idx;
 	int current_resolution_idx;
+	/* Embedded data of the current mode, see struct arducam_frame_meta */
+	u32 meta_width;
+	u32 meta_lines;
+	/* Active data lanes, reported to the receiver */
 	int lanes;
+	/* MIPI_LANES_REG was set to the DT lane count, redo it before streaming */
+	bool lanes_override;
+	/* DT link-frequencies, or link_freq_auto derived from the mode */
+	s64 *link_freqs;
+	unsigned int num_link_freqs;
+	s64 link_freq_auto;
+	struct v4l2_ctrl *link_freq;
 	struct gpio_desc *xclr_gpio;
 	struct regulator_bulk_data supplies[arducam_NUM_SUPPLIES];
 
@@ -278,6 +514,8 @@ struct arducam {
 	const struct arducam_mode *mode;
 	int bayer_order_volatile;
 	struct v4l2_rect crop;
+	/* A crop was set, the image pad is crop sized until the next set_fmt */
+	bool crop_set;
 	/*
 	 * Mutex for serialized access:
 	 * Protect sensor module set pad format and start/stop streaming safely.
@@ -285,13 +523,36 @@ struct arducam {
 	struct mutex mutex;
 
 	int power_count;
+	/* Powered up again after a suspend, see arducam_restore_state() */
+	bool restore_pending;
+	struct arducam_snapshot snapshot;
 	/* Streaming on/off */
 	bool streaming;
-	bool wait_until_free;
-	struct v4l2_ctrl *ctrls[32];
+	/* See struct arducam_sync_group */
+	struct arducam_sync_group *sync_group;
+	struct list_head sync_node;
+	enum arducam_sync_role sync_role;
+	/*
+	 * Control writes queued while streaming, oldest first, at most one
+	 * entry per control id. Protected by mutex.
+	 */
+	struct list_head ctrl_queue;
+	struct work_struct ctrl_work;
+	/* Bridge supports CTRL_HOLD_REG */
+	bool ctrl_hold;
+	/* Frame the last held group was committed on */
+	u32 applied_frame;
+	/* A held group was sent, CTRL_APPLY_FRAME_REG is due once latched */
+	bool applied_pending;
+	/* Controls queued by s_ctrl while starting the stream */
+	bool ctrl_batching;
+	struct reg_sequence *ctrl_batch;
+	int num_ctrl_batch;
+	int max_ctrl_batch;
 };
 
 static int is_raw(int pixformat);
+static int arducam_data_type_bpp(int data_type);
 static u32 data_type_to_mbus_code(int data_type, int bayer_order);
 
 
@@ -300,51 +561,128 @@ static inline struct arducam *to_arducam(struct v4l2_subdev *_sd)
 	return container_of(_sd, struct arducam, sd);
 }
 
-/* Write registers up to 2 at a time */
-static int arducam_write_reg(struct arducam *arducam, u16 reg, u32 len, u32 val)
+static inline struct arducam *client_to_arducam(struct i2c_client *client)
 {
-	struct i2c_client *client = v4l2_get_subdevdata(&arducam->sd);
-	u8 buf[6];
+	return to_arducam(i2c_get_clientdata(client));
+}
 
-	v4l2_dbg(1, debug, client, "%s: Write 0x%04x to register 0x%02x.\n",
-			 __func__, val, reg);
+/*
+ * Descriptor windows. Their contents only change when the index register
+ * in front of them is written (or the bridge is reset), so regmap caches
+ * them and arducam_invalidate_windows() drops them on index changes.
+ * Everything else, STREAM_ON and SYSTEM_IDLE_REG included, is volatile.
+ */
+static bool arducam_reg_volatile(struct device *dev, unsigned int reg)
+{
+	switch (reg) {
+	case PIXFORMAT_TYPE_REG ... FLIPS_DONT_CHANGE_ORDER_REG:
+	case FORMAT_WIDTH_REG ... FORMAT_HEIGHT_REG:
+	case CTRL_MIN_REG ... CTRL_DEF_REG:
+	case CTRL_LATENCY_REG:
+	case IPC_SEL_TOP_REG ... IPC_SEL_HEIGHT_REG:
+		return false;
+	default:
+		return true;
+	}
+}
 
-	if (len > 4)
-		return -EINVAL;
+static bool arducam_reg_readable(struct device *dev, unsigned int reg)
+{
+	switch (reg) {
+	case STREAM_ON ... DEVICE_ID_REG:
+	case SYSTEM_IDLE_REG ... METADATA_LINES_REG:
+	case PIXFORMAT_INDEX_REG ... FLIPS_DONT_CHANGE_ORDER_REG:
+	case RESOLUTION_INDEX_REG ... FORMAT_HEIGHT_REG:
+	case CTRL_INDEX_REG ... CTRL_LATENCY_REG:
+	case IPC_SEL_TARGET_REG ... IPC_SEL_ALIGN_REG:
+	case DESC_LAYOUT_REG ... DESC_PAGE_REG:
+	case DESC_WINDOW_BASE ... DESC_WINDOW_BASE + DESC_WINDOW_WORDS - 1:
+		return true;
+	default:
+		return false;
+	}
+}
 
-	put_unaligned_be16(reg, buf);
-	put_unaligned_be32(val << (8 * (4 - len)), buf + 2);
-	if (i2c_master_send(client, buf, len + 2) != len + 2)
-		return -EIO;
+/* Keep the descriptor window out of the debugfs register dump */
+static bool arducam_reg_precious(struct device *dev, unsigned int reg)
+{
+	return reg >= DESC_WINDOW_BASE &&
+		reg < DESC_WINDOW_BASE + DESC_WINDOW_WORDS;
+}
 
-	return 0;
+static const struct regmap_config arducam_regmap_config = {
+	.reg_bits = 16,
+	.val_bits = 32,
+	.max_register = DESC_WINDOW_BASE + DESC_WINDOW_WORDS - 1,
+	.volatile_reg = arducam_reg_volatile,
+	.readable_reg = arducam_reg_readable,
+	.precious_reg = arducam_reg_precious,
+	.cache_type = REGCACHE_RBTREE,
+};
+
+/* Forget every cached register, e.g. after the bridge has been reset. */
+static void arducam_invalidate_cache(struct arducam *priv)
+{
+	int i;
+
+	regcache_drop_region(priv->regmap, 0, arducam_regmap_config.max_register);
+	priv->sel_target = U32_MAX;
+	if (priv->ctrl_entries)
+		for (i = 0; i < priv->num_ctrl_descs; i++)
+			priv->ctrl_entries[i].written = false;
+}
+
+/* Drop the cached windows that depend on a register that was written. */
+static void arducam_invalidate_windows(struct arducam *priv, u16 reg, u32 val)
+{
+	struct regmap *map = priv->regmap;
+
+	switch (reg) {
+	case PIXFORMAT_INDEX_REG:
+		regcache_drop_region(map, PIXFORMAT_TYPE_REG,
+				     FLIPS_DONT_CHANGE_ORDER_REG);
+		fallthrough;
+	case RESOLUTION_INDEX_REG:
+		regcache_drop_region(map, FORMAT_WIDTH_REG, FORMAT_HEIGHT_REG);
+		fallthrough;
+	case CTRL_VALUE_REG:
+		/* pan/zoom and mode changes move the crop */
+		regcache_drop_region(map, IPC_SEL_TOP_REG, IPC_SEL_HEIGHT_REG);
+		fallthrough;
+	case CTRL_INDEX_REG:
+	case CTRL_ID_REG:
+		regcache_drop_region(map, CTRL_MIN_REG, CTRL_DEF_REG);
+		regcache_drop_region(map, CTRL_LATENCY_REG, CTRL_LATENCY_REG);
+		break;
+	case IPC_SEL_TOP_REG ... IPC_SEL_HEIGHT_REG:
+		/* The bridge aligns the window it was given */
+		regcache_drop_region(map, IPC_SEL_TOP_REG, IPC_SEL_HEIGHT_REG);
+		break;
+	case MIPI_LANES_REG:
+		/* Read back what the bridge took, not what was asked */
+		regcache_drop_region(map, MIPI_LANES_REG, MIPI_LANES_REG);
+		break;
+	case IPC_SEL_TARGET_REG:
+		if (val != priv->sel_target)
+			regcache_drop_region(map, IPC_SEL_TOP_REG,
+					     IPC_SEL_HEIGHT_REG);
+		priv->sel_target = val;
+		break;
+	}
 }
 
 static int arducam_readl_reg(struct i2c_client *client,
 								   u16 addr, u32 *val)
 {
-    u16 buf = htons(addr);
-    u32 data;
-    struct i2c_msg msgs[2] = {
-		{
-			.addr = client->addr,
-			.flags= 0,
-			.len = 2,
-			.buf = (u8 *)&buf,
-		},
-		{
-			.addr = client->addr,
-			.flags= I2C_M_RD,
-			.len = 4,
-			.buf = (u8 *)&data,
-		},
-	};
+	struct arducam *priv = client_to_arducam(client);
+	unsigned int data;
+	int ret;
 
-	if(i2c_transfer(client->adapter, msgs, 2) != 2){
-		return -1;
-	}
+	ret = regmap_read(priv->regmap, addr, &data);
+	if (ret)
+		return ret;
 
-	*val = ntohl(data);
+	*val = data;
 
 	return 0;
 }
@@ -352,101 +690,653 @@ static int arducam_readl_reg(struct i2c_client *client,
 static int arducam_writel_reg(struct i2c_client *client,
 									u16 addr, u32 val)
 {
-	u8 data[6];
+	struct arducam *priv = client_to_arducam(client);
+	int ret;
+
+	ret = regmap_write(priv->regmap, addr, val);
+	if (ret)
+		return ret;
+
+	arducam_invalidate_windows(priv, addr, val);
+
+	return 0;
+}
+
+/*
+ * Read count consecutive 32-bit registers starting at addr. The bridge
+ * auto-increments the register address, so a cache miss costs a single
+ * address write and a single read. Fully cached windows are served
+ * without touching the bus. Called with reg_lock held, since the cache
+ * mode is switched around the access.
+ */
+static int arducam_readl_regs(struct i2c_client *client,
+								u16 addr, u32 *vals, int count)
+{
+	struct arducam *priv = client_to_arducam(client);
+	struct regmap *map = priv->regmap;
+	u8 data[I2C_BLOCK_MAX_REGS * 4];
+	bool cacheable = true;
+	int i, ret;
+
+	if (count <= 0 || count > I2C_BLOCK_MAX_REGS)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++)
+		cacheable &= !arducam_reg_volatile(&client->dev, addr + i);
+
+	if (cacheable) {
+		regcache_cache_only(map, true);
+		ret = regmap_bulk_read(map, addr, vals, count);
+		regcache_cache_only(map, false);
+		if (!ret)
+			return 0;
+	}
+
+	regcache_cache_bypass(map, true);
+	ret = regmap_raw_read(map, addr, data, count * 4);
+	regcache_cache_bypass(map, false);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < count; i++)
+		vals[i] = get_unaligned_be32(data + i * 4);
+
+	/* Populate the cache with what was just read */
+	regcache_cache_only(map, true);
+	for (i = 0; i < count; i++)
+		if (!arducam_reg_volatile(&client->dev, addr + i))
+			regmap_write(map, addr + i, vals[i]);
+	regcache_cache_only(map, false);
+
+	return 0;
+}
+
+static int arducam_writel_regs(struct i2c_client *client,
+								u16 addr, const u32 *vals, int count)
+{
+	struct arducam *priv = client_to_arducam(client);
+	int i, ret;
+
+	if (count <= 0 || count > I2C_BLOCK_MAX_REGS)
+		return -EINVAL;
+
+	ret = regmap_bulk_write(priv->regmap, addr, vals, count);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < count; i++)
+		arducam_invalidate_windows(priv, addr + i, vals[i]);
+
+	return 0;
+}
+
+static void arducam_hist_add(struct arducam_hist *hist, u32 us)
+{
+	int n = us ? min(ilog2(us) + 1, ARDUCAM_HIST_BUCKETS - 1) : 0;
+
+	hist->bucket[n]++;
+}
+
+/*
+ * Account one I2C transfer of count registers at addr, started at start,
+ * that finished with ret. Called from the regmap bus, so accesses the
+ * register cache answers are not counted.
+ */
+static void arducam_record_xfer(struct i2c_client *client, bool write,
+				u16 addr, int count, ktime_t start, int ret)
+{
+	struct arducam *priv = client_to_arducam(client);
+	struct arducam_xfer_stats *stats;
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	stats = &priv->stats.xfer[min(addr >> 8, ARDUCAM_REG_BLOCKS - 1)];
+
+	spin_lock(&priv->stats_lock);
+	priv->stats.xfers++;
+	priv->stats.regs += count;
+	if (write)
+		stats->writes++;
+	else
+		stats->reads++;
+	stats->regs += count;
+	stats->failures += !!ret;
+	arducam_hist_add(&stats->hist, div_s64(ns, NSEC_PER_USEC));
+	spin_unlock(&priv->stats_lock);
+}
+
+/*
+ * Trace one register access of count registers at addr, started at
+ * start, that took retries extra attempts and finished with ret.
+ */
+static void arducam_trace_access(struct i2c_client *client, bool write,
+				 u16 addr, u32 val, int count, int retries,
+				 ktime_t start, int ret)
+{
+	struct arducam *priv = client_to_arducam(client);
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	if (write)
+		trace_arducam_write(client, addr, val, count, retries, ns, ret);
+	else
+		trace_arducam_read(client, addr, val, count, retries, ns, ret);
+
+	if (!retries)
+		return;
+
+	spin_lock(&priv->stats_lock);
+	priv->stats.xfer[min(addr >> 8, ARDUCAM_REG_BLOCKS - 1)].retries +=
+		retries;
+	spin_unlock(&priv->stats_lock);
+}
+
+/*
+ * regmap bus on top of plain I2C transfers, as regmap-i2c does, so that
+ * every transfer that actually reaches the bridge is accounted.
+ */
+static int arducam_bus_write(void *context, const void *data, size_t count)
+{
+	struct i2c_client *client = context;
+	ktime_t start = ktime_get();
+	int ret;
+
+	ret = i2c_master_send(client, data, count);
+	if (ret == count)
+		ret = 0;
+	else if (ret >= 0)
+		ret = -EIO;
+
+	/* 16-bit register address, then the 32-bit values */
+	arducam_record_xfer(client, true, get_unaligned_be16(data),
+			    (count - 2) / 4, start, ret);
+
+	return ret;
+}
+
+static int arducam_bus_read(void *context, const void *reg, size_t reg_size,
+			    void *val, size_t val_size)
+{
+	struct i2c_client *client = context;
 	struct i2c_msg msgs[2] = {
 		{
 			.addr = client->addr,
-			.flags= 0,
-			.len = 6,
-			.buf = data,
+			.len = reg_size,
+			.buf = (u8 *)reg,
+		}, {
+			.addr = client->addr,
+			.flags = I2C_M_RD,
+			.len = val_size,
+			.buf = val,
 		},
 	};
-	addr = htons(addr);
-	val = htonl(val);
-	memcpy(data, &addr, 2);
-	memcpy(data + 2, &val, 4);
+	ktime_t start = ktime_get();
+	int ret;
 
-	if(i2c_transfer(client->adapter, msgs, 1) != 1)
-		return -1;
+	ret = i2c_transfer(client->adapter, msgs, ARRAY_SIZE(msgs));
+	if (ret == ARRAY_SIZE(msgs))
+		ret = 0;
+	else if (ret >= 0)
+		ret = -EIO;
 
-	return 0;
+	arducam_record_xfer(client, false, get_unaligned_be16(reg),
+			    val_size / 4, start, ret);
+
+	return ret;
 }
 
+static const struct regmap_bus arducam_regmap_bus = {
+	.write = arducam_bus_write,
+	.read = arducam_bus_read,
+	.reg_format_endian_default = REGMAP_ENDIAN_BIG,
+	.val_format_endian_default = REGMAP_ENDIAN_BIG,
+};
+
 int arducam_read(struct i2c_client *client, u16 addr, u32 *value)
 {
+	struct arducam *priv = client_to_arducam(client);
+	ktime_t start = ktime_get();
 	int ret;
 	int count = 0;
+
+	mutex_lock(&priv->reg_lock);
 	while (count++ < I2C_READ_RETRY_COUNT) {
 		ret = arducam_readl_reg(client, addr, value);
-		if(!ret) {
-			v4l2_dbg(1, debug, client, "%s: 0x%02x 0x%04x\n",
-				__func__, addr, *value);
-			return ret;
-		}
+		if(!ret)
+			break;
 	}
-	
+	mutex_unlock(&priv->reg_lock);
+	arducam_trace_access(client, false, addr, ret ? 0 : *value, 1,
+			     min(count, I2C_READ_RETRY_COUNT) - 1, start, ret);
+	if (!ret) {
+		v4l2_dbg(1, debug, client, "%s: 0x%02x 0x%04x\n",
+			__func__, addr, *value);
+		return ret;
+	}
+
 	v4l2_err(client, "%s: Reading register 0x%02x failed\n",
 			 __func__, addr);
 	return ret;
 }
 
+static irqreturn_t arducam_ready_irq(int irq, void *data)
+{
+	struct arducam *arducam = data;
+
+	complete(&arducam->idle_done);
+
+	return IRQ_HANDLED;
+}
+
+static void arducam_record_wait(struct arducam *priv, ktime_t start,
+								u32 polls, bool timeout)
+{
+	struct arducam_wait_stats *stats = &priv->wait_stats;
+	u32 us = ktime_us_delta(ktime_get(), start);
+
+	spin_lock(&priv->stats_lock);
+	stats->count++;
+	stats->polls += polls;
+	stats->timeouts += timeout;
+	stats->last_us = us;
+	stats->total_us += us;
+	if (us > stats->max_us)
+		stats->max_us = us;
+	arducam_hist_add(&priv->stats.wait_hist, us);
+	priv->stats.wait_ns += (u64)us * NSEC_PER_USEC;
+	spin_unlock(&priv->stats_lock);
+}
+
+/*
+ * Per-operation accounting: the I2C transfers and idle waits that
+ * happened between arducam_op_begin() and arducam_op_end() are charged to
+ * the operation. Concurrent operations on one device share the blame.
+ */
+static void arducam_op_begin(struct arducam *priv, struct arducam_op_ctx *ctx)
+{
+	spin_lock(&priv->stats_lock);
+	ctx->xfers = priv->stats.xfers;
+	ctx->regs = priv->stats.regs;
+	ctx->wait_ns = priv->stats.wait_ns;
+	spin_unlock(&priv->stats_lock);
+	ctx->start = ktime_get();
+}
+
+static void arducam_op_end(struct arducam *priv, enum arducam_op op,
+			   struct arducam_op_ctx *ctx)
+{
+	struct arducam_op_stats *stats = &priv->stats.op[op];
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), ctx->start));
+
+	spin_lock(&priv->stats_lock);
+	/* A reset in between leaves nothing sensible to charge */
+	if (priv->stats.xfers >= ctx->xfers &&
+	    priv->stats.wait_ns >= ctx->wait_ns) {
+		stats->calls++;
+		stats->xfers += priv->stats.xfers - ctx->xfers;
+		stats->regs += priv->stats.regs - ctx->regs;
+		stats->wait_ns += priv->stats.wait_ns - ctx->wait_ns;
+		stats->total_ns += ns;
+		if (ns > stats->max_ns)
+			stats->max_ns = ns;
+	}
+	spin_unlock(&priv->stats_lock);
+}
+
+/*
+ * Wait until the bridge reports SYSTEM_IDLE_REG == 0. If the bridge ready
+ * line is wired, sleep on its interrupt between checks; otherwise poll with
+ * a backoff capped at interval ms.
+ */
 static int wait_for_free(struct i2c_client *client, int interval) {
+	struct arducam *priv = to_arducam(i2c_get_clientdata(client));
+	ktime_t start = ktime_get();
+	ktime_t timeout = ktime_add_ms(start, ARDUCAM_IDLE_TIMEOUT_MS);
+	unsigned long poll_us = ARDUCAM_IDLE_POLL_MIN_US;
+	unsigned long max_poll_us = interval * USEC_PER_MSEC;
+	bool timed_out = false;
 	u32 value;
 	u32 count = 0;
-	while(count++ < (1000 / interval)) {
-		int ret = arducam_read(client, SYSTEM_IDLE_REG, &value);
-		if (!ret && !value) break;
-		msleep(interval);
+
+	trace_arducam_wait_enter(client, interval);
+
+	while (1) {
+		int ret;
+
+		if (priv->ready_irq > 0)
+			reinit_completion(&priv->idle_done);
+
+		count++;
+		ret = arducam_read(client, SYSTEM_IDLE_REG, &value);
+		if (!ret && !value)
+			break;
+
+		if (ktime_after(ktime_get(), timeout)) {
+			timed_out = true;
+			break;
+		}
+
+		if (priv->ready_irq > 0) {
+			wait_for_completion_timeout(&priv->idle_done,
+					msecs_to_jiffies(interval));
+		} else {
+			usleep_range(poll_us, poll_us + poll_us / 2);
+			poll_us = min(poll_us * 2, max_poll_us);
+		}
 	}
-	v4l2_dbg(1, debug, client, "%s: End wait, Count: %d.\n",
-			 __func__, count);
 
-	return 0;
+	arducam_record_wait(priv, start, count, timed_out);
+	trace_arducam_wait_exit(client, count, priv->wait_stats.last_us,
+				timed_out);
+	v4l2_dbg(1, debug, client, "%s: End wait, Count: %d, %u us.\n",
+			 __func__, count, priv->wait_stats.last_us);
+
+	return timed_out ? -ETIMEDOUT : 0;
 }
 
 int arducam_write(struct i2c_client *client, u16 addr, u32 value)
 {
+	struct arducam *priv = client_to_arducam(client);
+	ktime_t start = ktime_get();
 	int ret;
 	int count = 0;
+
+	mutex_lock(&priv->reg_lock);
 	while (count++ < I2C_WRITE_RETRY_COUNT) {
 		ret = arducam_writel_reg(client, addr, value);
 		if(!ret)
-			return ret;
+			break;
 	}
+	mutex_unlock(&priv->reg_lock);
+	arducam_trace_access(client, true, addr, value, 1,
+			     min(count, I2C_WRITE_RETRY_COUNT) - 1, start, ret);
+	if (!ret)
+		return ret;
+
 	v4l2_err(client, "%s: Write 0x%04x to register 0x%02x failed\n",
 			 __func__, value, addr);
 	return ret;
 }
 
-/* Get bayer order based on flip setting. */
-static u32 arducam_get_format_code(struct arducam *priv, struct arducam_format *format)
+int arducam_read_block(struct i2c_client *client, u16 addr,
+						u32 *vals, int count)
 {
-	unsigned int i, index;
-
-	if (!priv->bayer_order_volatile)
-		return data_type_to_mbus_code(format->data_type, format->bayer_order);
-
-	lockdep_assert_held(&priv->mutex);
-
-	i = format->bayer_order;
-
-	index = i;
-
-	i = (priv->hflip->val ? i^1 : i);
-	i = (priv->vflip->val ? i^2 : i);
+	struct arducam *priv = client_to_arducam(client);
+	ktime_t start = ktime_get();
+	int ret;
+	int retry = 0;
 
-	v4l2_dbg(1, debug, priv->client, "%s: before: %d, after: %d.\n",
-			 __func__, index, i);
+	mutex_lock(&priv->reg_lock);
+	while (retry++ < I2C_READ_RETRY_COUNT) {
+		ret = arducam_readl_regs(client, addr, vals, count);
+		if (!ret || ret == -EINVAL)
+			break;
+	}
+	mutex_unlock(&priv->reg_lock);
+	arducam_trace_access(client, false, addr, ret ? 0 : vals[0], count,
+			     min(retry, I2C_READ_RETRY_COUNT) - 1, start, ret);
+	if (!ret) {
+		v4l2_dbg(1, debug, client, "%s: 0x%02x, %d regs\n",
+			__func__, addr, count);
+		return ret;
+	}
 
-	return data_type_to_mbus_code(format->data_type, i);
+	v4l2_err(client, "%s: Reading %d registers from 0x%02x failed\n",
+			 __func__, count, addr);
+	return ret;
 }
 
-/* Power/clock management functions */
-static int arducam_power_on(struct device *dev)
+int arducam_write_block(struct i2c_client *client, u16 addr,
+						const u32 *vals, int count)
 {
-	struct i2c_client *client = to_i2c_client(dev);
-	struct v4l2_subdev *sd = i2c_get_clientdata(client);
-	struct arducam *arducam = to_arducam(sd);
+	struct arducam *priv = client_to_arducam(client);
+	ktime_t start = ktime_get();
+	int ret;
+	int retry = 0;
+
+	mutex_lock(&priv->reg_lock);
+	while (retry++ < I2C_WRITE_RETRY_COUNT) {
+		ret = arducam_writel_regs(client, addr, vals, count);
+		if (!ret || ret == -EINVAL)
+			break;
+	}
+	mutex_unlock(&priv->reg_lock);
+	arducam_trace_access(client, true, addr, vals[0], count,
+			     min(retry, I2C_WRITE_RETRY_COUNT) - 1, start, ret);
+	if (!ret)
+		return ret;
+
+	v4l2_err(client, "%s: Writing %d registers to 0x%02x failed\n",
+			 __func__, count, addr);
+	return ret;
+}
+
+/*
+ * Write an arbitrary register sequence as one regmap transaction list.
+ * Writes are idempotent, so a failed list is simply replayed.
+ */
+static int arducam_write_seq(struct i2c_client *client,
+						const struct reg_sequence *seq, int count)
+{
+	struct arducam *priv = client_to_arducam(client);
+	ktime_t start = ktime_get();
+	int i, ret;
+	int retry = 0;
+
+	if (!count)
+		return 0;
+
+	mutex_lock(&priv->reg_lock);
+	while (retry++ < I2C_WRITE_RETRY_COUNT) {
+		ret = regmap_multi_reg_write(priv->regmap, seq, count);
+		if (!ret)
+			break;
+	}
+	if (!ret)
+		for (i = 0; i < count; i++)
+			arducam_invalidate_windows(priv, seq[i].reg, seq[i].def);
+	mutex_unlock(&priv->reg_lock);
+	arducam_trace_access(client, true, seq[0].reg, seq[0].def, count,
+			     min(retry, I2C_WRITE_RETRY_COUNT) - 1, start, ret);
+	if (!ret)
+		return ret;
+
+	v4l2_err(client, "%s: Writing %d register pairs failed\n",
+			 __func__, count);
+	return ret;
+}
+
+static int arducam_write_reg(struct arducam *arducam, u16 reg, u32 len, u32 val)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&arducam->sd);
+
+	v4l2_dbg(1, debug, client, "%s: Write 0x%04x to register 0x%02x.\n",
+			 __func__, val, reg);
+
+	/* The bridge register map is 32 bits wide */
+	if (len != arducam_REG_VALUE_32BIT)
+		return -EINVAL;
+
+	return arducam_write(client, reg, val);
+}
+
+/*
+ * Read count words of the descriptor window into blob, converted to the
+ * little-endian blob format. Large windows go out as one raw transfer.
+ */
+static int arducam_read_window(struct i2c_client *client, u16 addr,
+							   __le32 *blob, int count)
+{
+	struct arducam *priv = client_to_arducam(client);
+	ktime_t start = ktime_get();
+	int ret;
+	int i;
+	int retry = 0;
+
+	mutex_lock(&priv->reg_lock);
+	while (retry++ < I2C_READ_RETRY_COUNT) {
+		ret = regmap_raw_read(priv->regmap, addr, blob,
+				      count * sizeof(*blob));
+		if (!ret)
+			break;
+	}
+	mutex_unlock(&priv->reg_lock);
+	arducam_trace_access(client, false, addr, 0, count,
+			     min(retry, I2C_READ_RETRY_COUNT) - 1, start, ret);
+	if (ret) {
+		v4l2_err(client, "%s: Reading %d registers from 0x%02x failed\n",
+				 __func__, count, addr);
+		return ret;
+	}
+
+	for (i = 0; i < count; i++)
+		blob[i] = cpu_to_le32(get_unaligned_be32(&blob[i]));
+
+	return 0;
+}
+
+/* Get bayer order based on flip setting. */
+static u32 arducam_get_format_code(struct arducam *priv, struct arducam_format *format)
+{
+	unsigned int i, index;
+
+	if (!priv->bayer_order_volatile)
+		return data_type_to_mbus_code(format->data_type, format->bayer_order);
+
+	lockdep_assert_held(&priv->mutex);
+
+	i = format->bayer_order;
+
+	index = i;
+
+	i = (priv->hflip->val ? i^1 : i);
+	i = (priv->vflip->val ? i^2 : i);
+
+	v4l2_dbg(1, debug, priv->client, "%s: before: %d, after: %d.\n",
+			 __func__, index, i);
+
+	return data_type_to_mbus_code(format->data_type, i);
+}
+static u32 arducam_res_key(int format_idx, u32 width, u32 height)
+{
+	return (width << 16) ^ height ^ (format_idx << 28);
+}
+
+static int arducam_lookup_code(struct arducam *priv, u32 code, bool exact)
+{
+	struct arducam_code_entry *entry;
+
+	hash_for_each_possible(priv->code_table, entry, node, code)
+		if (entry->code == code && (entry->exact || !exact))
+			return entry->format_idx;
+
+	return -EINVAL;
+}
+
+static int arducam_lookup_res(struct arducam *priv, int format_idx,
+			      u32 width, u32 height)
+{
+	struct arducam_res_entry *entry;
+
+	hash_for_each_possible(priv->res_table, entry, node,
+			       arducam_res_key(format_idx, width, height))
+		if (entry->format_idx == format_idx &&
+		    entry->width == width && entry->height == height)
+			return entry->resolution_idx;
+
+	return -EINVAL;
+}
+
+static void arducam_add_code(struct arducam *priv,
+			     struct arducam_code_entry *entry,
+			     u32 code, int format_idx, bool exact)
+{
+	entry->code = code;
+	entry->format_idx = format_idx;
+	entry->exact = exact;
+	hash_add(priv->code_table, &entry->node, code);
+}
+
+/*
+ * (Re)build the code table from the current mbus codes, which change with
+ * the flips when the bayer order is volatile. A raw format is also found
+ * by the codes of its other bayer orders, the flips pick the real one.
+ */
+static void arducam_build_code_table(struct arducam *priv)
+{
+	struct arducam_format *formats = priv->supported_formats;
+	struct arducam_code_entry *entry = priv->code_entries;
+	int i, order;
+	u32 code;
+
+	hash_init(priv->code_table);
+
+	/* Exact codes first, an alias never shadows one */
+	for (i = 0; i < priv->num_supported_formats; i++) {
+		if (arducam_lookup_code(priv, formats[i].mbus_code, true) < 0)
+			arducam_add_code(priv, entry++, formats[i].mbus_code,
+					 i, true);
+	}
+
+	for (i = 0; i < priv->num_supported_formats; i++) {
+		if (!is_raw(formats[i].data_type))
+			continue;
+
+		for (order = BAYER_ORDER_BGGR; order <= BAYER_ORDER_GRAY; order++) {
+			code = data_type_to_mbus_code(formats[i].data_type, order);
+			if (arducam_lookup_code(priv, code, false) < 0)
+				arducam_add_code(priv, entry++, code, i, false);
+		}
+	}
+}
+
+/* Build the lookup tables once the formats have been discovered. */
+static int arducam_build_lookup(struct arducam *priv)
+{
+	struct device *dev = &priv->client->dev;
+	struct arducam_format *formats = priv->supported_formats;
+	struct arducam_res_entry *entry;
+	int num_res = 0;
+	int i, j;
+
+	for (i = 0; i < priv->num_supported_formats; i++)
+		num_res += formats[i].num_resolution_set;
+
+	priv->code_entries = devm_kcalloc(dev,
+				priv->num_supported_formats * (BAYER_ORDER_GRAY + 2),
+				sizeof(*priv->code_entries), GFP_KERNEL);
+	priv->res_entries = devm_kcalloc(dev, num_res,
+				sizeof(*priv->res_entries), GFP_KERNEL);
+	if (!priv->code_entries || !priv->res_entries)
+		return -ENOMEM;
+
+	arducam_build_code_table(priv);
+
+	hash_init(priv->res_table);
+	entry = priv->res_entries;
+	for (i = 0; i < priv->num_supported_formats; i++) {
+		for (j = 0; j < formats[i].num_resolution_set; j++) {
+			entry->width = formats[i].resolution_set[j].width;
+			entry->height = formats[i].resolution_set[j].height;
+			/* Keep the first of duplicate sizes, as the scan did */
+			if (arducam_lookup_res(priv, i, entry->width,
+					       entry->height) >= 0)
+				continue;
+			entry->format_idx = i;
+			entry->resolution_idx = j;
+			hash_add(priv->res_table, &entry->node,
+				 arducam_res_key(i, entry->width, entry->height));
+			entry++;
+		}
+	}
+
+	return 0;
+}
+
+/* Power/clock management functions */
+static int arducam_power_on(struct device *dev)
+{
+	struct i2c_client *client = to_i2c_client(dev);
+	struct v4l2_subdev *sd = i2c_get_clientdata(client);
+	struct arducam *arducam = to_arducam(sd);
 	int ret;
 
 	ret = regulator_bulk_enable(arducam_NUM_SUPPLIES,
@@ -454,6 +1344,7 @@ static int arducam_power_on(struct device *dev)
 	if (ret) {
 		dev_err(&client->dev, "%s: failed to enable regulators\n",
 			__func__);
+		trace_arducam_power(client, true, ret);
 		return ret;
 	}
 
@@ -468,10 +1359,15 @@ static int arducam_power_on(struct device *dev)
 	usleep_range(arducam_XCLR_MIN_DELAY_US,
 		     arducam_XCLR_MIN_DELAY_US + arducam_XCLR_DELAY_RANGE_US);
 
+	/* The bridge comes out of reset, nothing cached is valid any more */
+	arducam_invalidate_cache(arducam);
+	trace_arducam_power(client, true, 0);
+
 	return 0;
 
 reg_off:
 	regulator_bulk_disable(arducam_NUM_SUPPLIES, arducam->supplies);
+	trace_arducam_power(client, true, ret);
 
 	return ret;
 }
@@ -483,8 +1379,24 @@ static int arducam_power_off(struct device *dev)
 	struct arducam *arducam = to_arducam(sd);
 
 	gpiod_set_value_cansleep(arducam->reset_gpio, 0);
+	arducam_invalidate_cache(arducam);
 	regulator_bulk_disable(arducam_NUM_SUPPLIES, arducam->supplies);
 	clk_disable_unprepare(arducam->xclk);
+	trace_arducam_power(client, false, 0);
+
+	return 0;
+}
+
+static int arducam_runtime_resume(struct device *dev)
+{
+	struct arducam *arducam = client_to_arducam(to_i2c_client(dev));
+	int ret;
+
+	ret = arducam_power_on(dev);
+	if (ret)
+		return ret;
+
+	arducam->restore_pending = true;
 
 	return 0;
 }
@@ -505,15 +1417,400 @@ static int arducam_open(struct v4l2_subdev *sd, struct v4l2_subdev_fh *fh)
 	try_fmt->field = V4L2_FIELD_NONE;
 
 	/* Initialize try_fmt for the embedded metadata pad */
-	try_fmt_meta->width = ARDUCAM_EMBEDDED_LINE_WIDTH;
-	try_fmt_meta->height = ARDUCAM_NUM_EMBEDDED_LINES;
+	mutex_lock(&arducam->mutex);
+	try_fmt_meta->width = arducam->meta_width;
+	try_fmt_meta->height = arducam->meta_lines;
+	mutex_unlock(&arducam->mutex);
 	try_fmt_meta->code = MEDIA_BUS_FMT_SENSOR_DATA;
 	try_fmt_meta->field = V4L2_FIELD_NONE;
 
 	return 0;
 }
 
-static int arducam_s_ctrl(struct v4l2_ctrl *ctrl)
+/*
+ * Generic latency classes, the same for every sensor, for bridges that do
+ * not report CTRL_LATENCY_REG. Unlisted controls settle.
+ */
+static enum arducam_ctrl_latency arducam_ctrl_default_latency(u32 id)
+{
+	switch (id) {
+	case V4L2_CID_EXPOSURE:
+	case V4L2_CID_ANALOGUE_GAIN:
+	case V4L2_CID_GAIN:
+	case V4L2_CID_DIGITAL_GAIN:
+		return ARDUCAM_LATENCY_FAST;
+	/* These reprogram the sensor mode or the ISP pipeline */
+	case V4L2_CID_ARDUCAM_FRAME_RATE:
+	case V4L2_CID_ARDUCAM_HDR:
+	case V4L2_CID_ARDUCAM_EFFECTS:
+	case V4L2_CID_ARDUCAM_PAN_X_ABSOLUTE:
+	case V4L2_CID_ARDUCAM_PAN_Y_ABSOLUTE:
+		return ARDUCAM_LATENCY_RECONFIG;
+	default:
+		return ARDUCAM_LATENCY_SETTLE;
+	}
+}
+
+/* The bridge's own class wins over the generic one */
+static enum arducam_ctrl_latency
+arducam_ctrl_desc_latency(const struct arducam_ctrl_desc *desc)
+{
+	if (desc->latency < NUM_ARDUCAM_LATENCIES)
+		return desc->latency;
+
+	return arducam_ctrl_default_latency(desc->id);
+}
+
+static struct arducam_ctrl_entry *arducam_ctrl_lookup(struct arducam *priv,
+						     u32 id)
+{
+	struct arducam_ctrl_entry *entry;
+
+	hash_for_each_possible(priv->ctrl_table, entry, node, id)
+		if (entry->id == id)
+			return entry;
+
+	return NULL;
+}
+
+static enum arducam_ctrl_latency arducam_ctrl_latency(struct arducam *priv,
+						      u32 id)
+{
+	struct arducam_ctrl_entry *entry = arducam_ctrl_lookup(priv, id);
+
+	if (entry)
+		return entry->latency_class;
+
+	return arducam_ctrl_default_latency(id);
+}
+
+/* Give the bridge the time it needs after a write of the given class */
+static void arducam_ctrl_settle(struct arducam *priv,
+				enum arducam_ctrl_latency latency)
+{
+	switch (latency) {
+	case ARDUCAM_LATENCY_FAST:
+		break;
+	case ARDUCAM_LATENCY_SETTLE:
+		usleep_range(200, 210);
+		break;
+	default:
+		wait_for_free(priv->client, 1);
+		break;
+	}
+}
+
+static bool arducam_ctrl_auto_on(const struct v4l2_ctrl *auto_ctrl, s32 val)
+{
+	if (auto_ctrl->id == V4L2_CID_EXPOSURE_AUTO)
+		return val != V4L2_EXPOSURE_MANUAL;
+
+	return val;
+}
+
+/*
+ * While its auto mode is on, the bridge changes the value itself and the
+ * acknowledged value cannot be trusted to still hold.
+ */
+static bool arducam_ctrl_entry_volatile(const struct arducam_ctrl_entry *entry)
+{
+	return entry->auto_ctrl &&
+		arducam_ctrl_auto_on(entry->auto_ctrl, entry->auto_ctrl->val);
+}
+
+static bool arducam_ctrl_shadow_hit(struct arducam *priv, u32 id, s32 val)
+{
+	struct arducam_ctrl_entry *entry = arducam_ctrl_lookup(priv, id);
+
+	return entry && !arducam_ctrl_entry_volatile(entry) && entry->written &&
+		entry->last == val;
+}
+
+static void arducam_ctrl_shadow_set(struct arducam *priv, u32 id, s32 val)
+{
+	struct arducam_ctrl_entry *entry = arducam_ctrl_lookup(priv, id);
+	int i;
+
+	if (!entry)
+		return;
+
+	entry->last = val;
+	entry->written = true;
+
+	/* Whatever the auto mode did, the bridge's values are unknown now */
+	for (i = 0; i < priv->num_ctrl_descs; i++)
+		if (priv->ctrl_entries[i].auto_ctrl == entry->ctrl)
+			priv->ctrl_entries[i].written = false;
+}
+
+static void arducam_ctrl_shadow_drop(struct arducam *priv, u32 id)
+{
+	struct arducam_ctrl_entry *entry = arducam_ctrl_lookup(priv, id);
+
+	if (entry)
+		entry->written = false;
+}
+
+static int arducam_batch_ctrl(struct arducam *priv, u32 id, s32 val)
+{
+	struct reg_sequence *seq;
+
+	if (priv->num_ctrl_batch + 2 > priv->max_ctrl_batch)
+		return -ENOSPC;
+
+	seq = &priv->ctrl_batch[priv->num_ctrl_batch];
+	seq[0] = (struct reg_sequence){ CTRL_ID_REG, id };
+	seq[1] = (struct reg_sequence){ CTRL_VALUE_REG, val };
+	priv->num_ctrl_batch += 2;
+
+	return 0;
+}
+
+/*
+ * Send (CTRL_ID, CTRL_VALUE) pairs. FAST controls are gathered into one
+ * transaction list; a run ends with the first control that needs to settle,
+ * and the settle follows before anything else is sent.
+ */
+static int arducam_write_ctrl_seq(struct arducam *priv,
+				  const struct reg_sequence *seq, int count)
+{
+	enum arducam_ctrl_latency latency, run = ARDUCAM_LATENCY_FAST;
+	int start = 0;
+	int i, ret;
+
+	for (i = 0; i < count; i += 2) {
+		latency = arducam_ctrl_latency(priv, seq[i].def);
+		run = max(run, latency);
+		if (i + 2 < count && latency == ARDUCAM_LATENCY_FAST)
+			continue;
+
+		ret = arducam_write_seq(priv->client, &seq[start], i + 2 - start);
+		if (ret)
+			return ret;
+
+		for (; start < i + 2; start += 2)
+			arducam_ctrl_shadow_set(priv, seq[start].def,
+						seq[start + 1].def);
+
+		arducam_ctrl_settle(priv, run);
+		run = ARDUCAM_LATENCY_FAST;
+	}
+
+	v4l2_dbg(1, debug, priv->client, "%s: %d controls applied\n",
+			 __func__, count / 2);
+
+	return 0;
+}
+
+static int arducam_flush_ctrl_batch(struct arducam *priv)
+{
+	return arducam_write_ctrl_seq(priv, priv->ctrl_batch,
+				      priv->num_ctrl_batch);
+}
+
+/*
+ * Queue a control write for arducam_ctrl_work(). A pending write to the
+ * same control is superseded: it takes the new value and moves to the
+ * tail, so the bridge sees writes in the order of their latest update.
+ */
+static int arducam_queue_ctrl(struct arducam *priv, u32 id, s32 val)
+{
+	struct arducam_ctrl_cmd *cmd;
+
+	list_for_each_entry(cmd, &priv->ctrl_queue, list) {
+		if (cmd->id == id) {
+			cmd->val = val;
+			list_move_tail(&cmd->list, &priv->ctrl_queue);
+			return 0;
+		}
+	}
+
+	if (arducam_ctrl_shadow_hit(priv, id, val))
+		return 0;
+
+	cmd = kmalloc(sizeof(*cmd), GFP_KERNEL);
+	if (!cmd)
+		return -ENOMEM;
+
+	cmd->id = id;
+	cmd->val = val;
+	list_add_tail(&cmd->list, &priv->ctrl_queue);
+	queue_work(system_highpri_wq, &priv->ctrl_work);
+
+	return 0;
+}
+
+static void arducam_ctrl_queue_discard(struct arducam *priv)
+{
+	struct arducam_ctrl_cmd *cmd, *tmp;
+
+	list_for_each_entry_safe(cmd, tmp, &priv->ctrl_queue, list) {
+		list_del(&cmd->list);
+		kfree(cmd);
+	}
+}
+
+/* Controls that have to change on the same frame to be measurable */
+static bool arducam_ctrl_is_frame_sync(u32 id)
+{
+	switch (id) {
+	case V4L2_CID_EXPOSURE:
+	case V4L2_CID_ANALOGUE_GAIN:
+	case V4L2_CID_GAIN:
+	case V4L2_CID_VBLANK:
+	case V4L2_CID_ARDUCAM_FRAME_RATE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Commit the run of frame-sync controls at the head of the queue inside
+ * one grouped hold, so they all land on the same frame. Later writes stay
+ * queued behind any earlier write, so the queue order is kept. *latency
+ * is set to what the caller has to wait for, outside the mutex, before
+ * arducam_ctrl_read_applied() can tell which frame the group landed on.
+ */
+static int arducam_ctrl_queue_send_held(struct arducam *priv,
+					enum arducam_ctrl_latency *latency)
+{
+	struct reg_sequence seq[2 + 2 * ARDUCAM_CTRL_HOLD_MAX];
+	struct arducam_ctrl_cmd *cmd, *tmp;
+	LIST_HEAD(group);
+	int count = 0;
+	int ret;
+
+	seq[count++] = (struct reg_sequence){ CTRL_HOLD_REG, 1 };
+	list_for_each_entry_safe(cmd, tmp, &priv->ctrl_queue, list) {
+		if (!arducam_ctrl_is_frame_sync(cmd->id) ||
+		    count + 3 > ARRAY_SIZE(seq))
+			break;
+
+		seq[count++] = (struct reg_sequence){ CTRL_ID_REG, cmd->id };
+		seq[count++] = (struct reg_sequence){ CTRL_VALUE_REG, cmd->val };
+		list_move_tail(&cmd->list, &group);
+	}
+	seq[count++] = (struct reg_sequence){ CTRL_HOLD_REG, 0 };
+
+	ret = arducam_write_seq(priv->client, seq, count);
+
+	list_for_each_entry_safe(cmd, tmp, &group, list) {
+		if (!ret)
+			arducam_ctrl_shadow_set(priv, cmd->id, cmd->val);
+		list_del(&cmd->list);
+		kfree(cmd);
+	}
+	if (ret)
+		return ret;
+
+	/*
+	 * The group is latched at the next frame start and the bridge stays
+	 * busy until then, so the caller waits for idle.
+	 */
+	*latency = ARDUCAM_LATENCY_RECONFIG;
+	priv->applied_pending = true;
+	v4l2_dbg(1, debug, priv->client, "%s: %d controls held\n",
+			 __func__, (count - 2) / 2);
+
+	return 0;
+}
+
+/*
+ * Record the frame the last held group landed on, once the caller has
+ * waited for the latch. Must be called with priv->mutex held.
+ */
+static void arducam_ctrl_read_applied(struct arducam *priv)
+{
+	u32 frame;
+
+	if (!priv->applied_pending)
+		return;
+	priv->applied_pending = false;
+
+	if (priv->streaming &&
+	    !arducam_read(priv->client, CTRL_APPLY_FRAME_REG, &frame)) {
+		priv->applied_frame = frame;
+		v4l2_dbg(1, debug, priv->client, "%s: frame %u\n",
+				 __func__, frame);
+	}
+}
+
+/*
+ * Send the oldest queued write. Must be called with priv->mutex held.
+ * Writes queued for a stream that has since stopped are dropped, the
+ * next stream start applies the current values anyway.
+ * Return the latency class of what was sent, or -ENODATA if nothing was.
+ */
+static int arducam_ctrl_queue_send_one(struct arducam *priv)
+{
+	enum arducam_ctrl_latency latency;
+	struct arducam_ctrl_cmd *cmd;
+	struct reg_sequence seq[2];
+
+	if (list_empty(&priv->ctrl_queue))
+		return -ENODATA;
+
+	if (!priv->streaming) {
+		arducam_ctrl_queue_discard(priv);
+		return -ENODATA;
+	}
+
+	cmd = list_first_entry(&priv->ctrl_queue, struct arducam_ctrl_cmd, list);
+	if (priv->ctrl_hold && arducam_ctrl_is_frame_sync(cmd->id)) {
+		if (arducam_ctrl_queue_send_held(priv, &latency))
+			return ARDUCAM_LATENCY_SETTLE;
+		return latency;
+	}
+
+	list_del(&cmd->list);
+
+	latency = arducam_ctrl_latency(priv, cmd->id);
+
+	seq[0] = (struct reg_sequence){ CTRL_ID_REG, cmd->id };
+	seq[1] = (struct reg_sequence){ CTRL_VALUE_REG, cmd->val };
+	if (!arducam_write_seq(priv->client, seq, ARRAY_SIZE(seq)))
+		arducam_ctrl_shadow_set(priv, cmd->id, cmd->val);
+
+	kfree(cmd);
+
+	return latency;
+}
+
+static void arducam_ctrl_work(struct work_struct *work)
+{
+	struct arducam *priv = container_of(work, struct arducam, ctrl_work);
+	int latency;
+
+	do {
+		mutex_lock(&priv->mutex);
+		arducam_ctrl_read_applied(priv);
+		latency = arducam_ctrl_queue_send_one(priv);
+		mutex_unlock(&priv->mutex);
+
+		/* Same pacing as the synchronous path, without the handler lock */
+		if (latency >= 0)
+			arducam_ctrl_settle(priv, latency);
+	} while (latency >= 0);
+}
+
+/* Send everything queued and wait until the bridge has applied it. */
+static int arducam_ctrl_queue_flush(struct arducam *priv)
+{
+	int latency;
+
+	while ((latency = arducam_ctrl_queue_send_one(priv)) >= 0) {
+		arducam_ctrl_settle(priv, latency);
+		arducam_ctrl_read_applied(priv);
+	}
+
+	if (!priv->streaming)
+		return 0;
+
+	return wait_for_free(priv->client, 1);
+}
+
+static int __arducam_s_ctrl(struct v4l2_ctrl *ctrl)
 {
 	int ret, i;
 	struct arducam *priv = 
@@ -527,33 +1824,116 @@ static int arducam_s_ctrl(struct v4l2_ctrl *ctrl)
 				arducam_get_format_code(
 					priv, &supported_formats[i]);
 		}
+		arducam_build_code_table(priv);
+	}
+
+	v4l2_dbg(1, debug, priv->client, "%s: cid = (0x%X), value = (%d).\n",
+			 __func__, ctrl->id, ctrl->val);
+
+	if (ctrl->id == V4L2_CID_ARDUCAM_SYNC_FLUSH)
+		return arducam_ctrl_queue_flush(priv);
+
+	/* Follows the mode, see arducam_update_link_freq() */
+	if (ctrl == priv->link_freq)
+		return 0;
+
+	if (async_ctrl && priv->streaming && !priv->ctrl_batching) {
+		trace_arducam_s_ctrl(priv->client, ctrl->id, ctrl->val,
+				     ARDUCAM_CTRL_QUEUED);
+		return arducam_queue_ctrl(priv, ctrl->id, ctrl->val);
+	}
+
+	/* The bridge already holds this value */
+	if (arducam_ctrl_shadow_hit(priv, ctrl->id, ctrl->val)) {
+		trace_arducam_s_ctrl(priv->client, ctrl->id, ctrl->val,
+				     ARDUCAM_CTRL_SKIPPED);
+		return 0;
+	}
+
+	if (priv->ctrl_batching) {
+		trace_arducam_s_ctrl(priv->client, ctrl->id, ctrl->val,
+				     ARDUCAM_CTRL_BATCHED);
+		return arducam_batch_ctrl(priv, ctrl->id, ctrl->val);
 	}
 
-	v4l2_dbg(1, debug, priv->client, "%s: cid = (0x%X), value = (%d).\n",
-			 __func__, ctrl->id, ctrl->val);
-	
+	trace_arducam_s_ctrl(priv->client, ctrl->id, ctrl->val,
+			     ARDUCAM_CTRL_WRITTEN);
 
 	ret = arducam_write(priv->client, CTRL_ID_REG, ctrl->id);
 	ret += arducam_write(priv->client, CTRL_VALUE_REG, ctrl->val);
 	if (ret < 0)
 		return -EINVAL;
+	arducam_ctrl_shadow_set(priv, ctrl->id, ctrl->val);
 
-	// When starting streaming, controls are set in batches, 
-	// and the short interval will cause some controls to be unsuccessfully set.
-	if (priv->wait_until_free)
-		wait_for_free(priv->client, 1);
-	else
-		usleep_range(200, 210);
+	arducam_ctrl_settle(priv, arducam_ctrl_latency(priv, ctrl->id));
 
 	return 0;
 }
 
 
+static int arducam_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct arducam *priv =
+		container_of(ctrl->handler, struct arducam, ctrl_handler);
+	struct arducam_ctrl_entry *entry = arducam_ctrl_lookup(priv, ctrl->id);
+	struct arducam_op_ctx ctx;
+	int ret;
+	u32 us;
+
+	arducam_op_begin(priv, &ctx);
+	ret = __arducam_s_ctrl(ctrl);
+	arducam_op_end(priv, ARDUCAM_OP_S_CTRL, &ctx);
+
+	us = ktime_us_delta(ktime_get(), ctx.start);
+	spin_lock(&priv->stats_lock);
+	if (entry) {
+		struct arducam_ctrl_stats *stats = &entry->stats;
+
+		stats->count++;
+		stats->total_us += us;
+		if (us > stats->max_us)
+			stats->max_us = us;
+	}
+	arducam_hist_add(&priv->stats.ctrl_hist, us);
+	spin_unlock(&priv->stats_lock);
+
+	return ret;
+}
+
+static int arducam_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct arducam *priv =
+		container_of(ctrl->handler, struct arducam, ctrl_handler);
+	u32 frame = 0;
+	int ret;
+
+	switch (ctrl->id) {
+	case V4L2_CID_ARDUCAM_APPLIED_FRAME:
+		frame = priv->applied_frame;
+		break;
+	case V4L2_CID_ARDUCAM_FRAME_COUNT:
+		/* The counter only runs while streaming */
+		if (priv->streaming) {
+			ret = arducam_read(priv->client, FRAME_COUNT_REG, &frame);
+			if (ret)
+				return ret;
+		}
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	ctrl->val = frame & INT_MAX;
+
+	return 0;
+}
+
 static const struct v4l2_ctrl_ops arducam_ctrl_ops = {
+	.g_volatile_ctrl = arducam_g_volatile_ctrl,
 	.s_ctrl = arducam_s_ctrl,
 };
 
-static int arducam_csi2_enum_mbus_code(
+static int __arducam_csi2_enum_mbus_code(
 			struct v4l2_subdev *sd,
 			struct v4l2_subdev_pad_config *cfg,
 			struct v4l2_subdev_mbus_code_enum *code)
@@ -581,7 +1961,7 @@ static int arducam_csi2_enum_mbus_code(
 	return 0;
 }
 
-static int arducam_csi2_enum_framesizes(
+static int __arducam_csi2_enum_framesizes(
 			struct v4l2_subdev *sd,
 			struct v4l2_subdev_pad_config *cfg,
 			struct v4l2_subdev_frame_size_enum *fse)
@@ -589,7 +1969,6 @@ static int arducam_csi2_enum_framesizes(
 	int i;
 	struct arducam *priv = to_arducam(sd);
 	struct arducam_format *supported_formats = priv->supported_formats;
-	int num_supported_formats = priv->num_supported_formats;
 
 	if (fse->pad >= NUM_PADS)
 		return -EINVAL;
@@ -598,39 +1977,43 @@ static int arducam_csi2_enum_framesizes(
 			 __func__, fse->code, fse->index);
 
 	if (fse->pad == IMAGE_PAD) {
-		for (i = 0; i < num_supported_formats; i++) {
-			if (fse->code == supported_formats[i].mbus_code) {
-				if (fse->index >= supported_formats[i].num_resolution_set)
-					return -EINVAL;
-				fse->min_width = fse->max_width =
-					supported_formats[i].resolution_set[fse->index].width;
-				fse->min_height = fse->max_height =
-					supported_formats[i].resolution_set[fse->index].height;
-				return 0;
-			}
+		mutex_lock(&priv->mutex);
+		i = arducam_lookup_code(priv, fse->code, true);
+		if (i < 0 || fse->index >= supported_formats[i].num_resolution_set) {
+			mutex_unlock(&priv->mutex);
+			return -EINVAL;
 		}
+		fse->min_width = fse->max_width =
+			supported_formats[i].resolution_set[fse->index].width;
+		fse->min_height = fse->max_height =
+			supported_formats[i].resolution_set[fse->index].height;
+		mutex_unlock(&priv->mutex);
+		return 0;
 	} else {
 		if (fse->code != MEDIA_BUS_FMT_SENSOR_DATA || fse->index > 0)
 			return -EINVAL;
 
-		fse->min_width = ARDUCAM_EMBEDDED_LINE_WIDTH;
+		mutex_lock(&priv->mutex);
+		fse->min_width = priv->meta_width;
 		fse->max_width = fse->min_width;
-		fse->min_height = ARDUCAM_NUM_EMBEDDED_LINES;
+		fse->min_height = priv->meta_lines;
 		fse->max_height = fse->min_height;
+		mutex_unlock(&priv->mutex);
 	}
 
-	return -EINVAL;
+	return 0;
 }
 
-static void arducam_update_metadata_pad_format(struct v4l2_subdev_format *fmt)
+static void arducam_update_metadata_pad_format(struct arducam *priv,
+					       struct v4l2_subdev_format *fmt)
 {
-	fmt->format.width = ARDUCAM_EMBEDDED_LINE_WIDTH;
-	fmt->format.height = ARDUCAM_NUM_EMBEDDED_LINES;
+	fmt->format.width = priv->meta_width;
+	fmt->format.height = priv->meta_lines;
 	fmt->format.code = MEDIA_BUS_FMT_SENSOR_DATA;
 	fmt->format.field = V4L2_FIELD_NONE;
 }
 
-static int arducam_csi2_get_fmt(struct v4l2_subdev *sd,
+static int __arducam_csi2_get_fmt(struct v4l2_subdev *sd,
 								struct v4l2_subdev_pad_config *cfg,
 								struct v4l2_subdev_format *format)
 {
@@ -648,6 +2031,10 @@ static int arducam_csi2_get_fmt(struct v4l2_subdev *sd,
 			current_format->resolution_set[priv->current_resolution_idx].width;
 		format->format.height =
 			current_format->resolution_set[priv->current_resolution_idx].height;
+		if (priv->crop_set) {
+			format->format.width = priv->crop.width;
+			format->format.height = priv->crop.height;
+		}
 		format->format.code = current_format->mbus_code;
 		format->format.field = V4L2_FIELD_NONE;
 		format->format.colorspace = V4L2_COLORSPACE_SRGB;
@@ -656,60 +2043,180 @@ static int arducam_csi2_get_fmt(struct v4l2_subdev *sd,
 			__func__, format->format.width,format->format.height,
 				format->format.code);
 	} else {
-		arducam_update_metadata_pad_format(format);
+		arducam_update_metadata_pad_format(priv, format);
 	}
 
 	mutex_unlock(&priv->mutex);
 	return 0;
 }
 
+/*
+ * Return true if mode a is a better pick than mode b for a request both
+ * cover: less to read out first, then the faster and leaner mode.
+ */
+static bool arducam_res_better(const struct arducam_resolution *a,
+			       const struct arducam_resolution *b)
+{
+	u64 area_a = (u64)a->width * a->height;
+	u64 area_b = (u64)b->width * b->height;
+
+	if (area_a != area_b)
+		return area_a < area_b;
+	if (a->max_fps != b->max_fps)
+		return a->max_fps > b->max_fps;
+
+	return a->pixel_rate && a->pixel_rate < b->pixel_rate;
+}
+
+/*
+ * Pick the mode of format_idx for a width x height request that has no
+ * exact match: the smallest readout that still covers the request, or,
+ * if none does, the nearest one as v4l2_find_nearest_size() measures it.
+ */
+static int arducam_find_nearest_res(struct arducam *priv, int format_idx,
+				    u32 width, u32 height)
+{
+	struct arducam_format *format = &priv->supported_formats[format_idx];
+	struct arducam_resolution *res = format->resolution_set;
+	u32 error, best_error = U32_MAX;
+	int covering = -1;
+	int nearest = 0;
+	int i;
+
+	for (i = 0; i < format->num_resolution_set; i++) {
+		if (res[i].width >= width && res[i].height >= height) {
+			if (covering < 0 || arducam_res_better(&res[i],
+							      &res[covering]))
+				covering = i;
+			continue;
+		}
+
+		error = abs((s32)(res[i].width - width)) +
+			abs((s32)(res[i].height - height));
+		if (error < best_error) {
+			best_error = error;
+			nearest = i;
+		}
+	}
+
+	return covering >= 0 ? covering : nearest;
+}
+
 static int arducam_csi2_get_fmt_idx_by_code(struct arducam *priv,
 											u32 mbus_code)
 {
+	return arducam_lookup_code(priv, mbus_code, false);
+}
+
+static struct v4l2_ctrl *get_control(struct arducam *priv, u32 id) {
+	struct arducam_ctrl_entry *entry = arducam_ctrl_lookup(priv, id);
+
+	return entry ? entry->ctrl : NULL;
+}
+
+/*
+ * Select the slowest link frequency that carries the current mode's pixel
+ * rate over the active lanes. Without link-frequencies in DT the single
+ * menu entry follows the mode instead.
+ */
+static int arducam_link_freq_cmp(const void *a, const void *b)
+{
+	u64 fa = *(const u64 *)a, fb = *(const u64 *)b;
+
+	return fa < fb ? -1 : fa > fb;
+}
+
+static void arducam_update_link_freq(struct arducam *priv)
+{
+	struct arducam_format *format =
+		&priv->supported_formats[priv->current_format_idx];
+	struct arducam_resolution *res =
+		&format->resolution_set[priv->current_resolution_idx];
+	u64 freq;
 	int i;
-	u32 data_type;
-	struct arducam_format *formats = priv->supported_formats;
 
-	for (i = 0; i < ARRAY_SIZE(codes); i++)
-		if (codes[i] == mbus_code)
-			break;
+	if (!priv->link_freq || !res->pixel_rate || !priv->lanes)
+		return;
 
-	if (i / 5 < 3)
-		data_type = i / 5 + 0x2a;
-	else 
-		data_type = U32_MAX;
+	/* DDR: two bits per lane per clock */
+	freq = div_u64(res->pixel_rate * arducam_data_type_bpp(format->data_type),
+		       2 * priv->lanes);
 
-	for (i = 0; i < priv->num_supported_formats; i++) {
-		if (formats[i].mbus_code == mbus_code)
-			return i; 
+	if (!priv->num_link_freqs) {
+		priv->link_freq_auto = freq;
+		return;
 	}
 
-	if (data_type != U32_MAX) {
-		for (i = 0; i < priv->num_supported_formats; i++) {
-			if (formats[i].data_type == data_type)
-				return i; 
-		}
+	for (i = 0; i < priv->num_link_freqs - 1; i++)
+		if (priv->link_freqs[i] >= freq)
+			break;
+	if (priv->link_freqs[i] < freq)
+		v4l2_warn(&priv->sd, "%ux%u needs %llu Hz, link is %lld Hz\n",
+			  res->width, res->height, freq, priv->link_freqs[i]);
+
+	__v4l2_ctrl_s_ctrl(priv->link_freq, i);
+}
+
+/* Size the metadata pad from the embedded data the bridge sends */
+static void arducam_learn_metadata(struct arducam *priv)
+{
+	u32 meta[2];
+
+	priv->meta_width = ARDUCAM_EMBEDDED_LINE_WIDTH;
+	priv->meta_lines = ARDUCAM_NUM_EMBEDDED_LINES;
+
+	/* METADATA_WIDTH_REG, METADATA_LINES_REG */
+	if (arducam_read_block(priv->client, METADATA_WIDTH_REG,
+			       meta, ARRAY_SIZE(meta)) ||
+	    meta[0] == NO_DATA_AVAILABLE || meta[1] == NO_DATA_AVAILABLE ||
+	    !meta[0] || !meta[1])
+		return;
+
+	if (meta[0] * meta[1] < sizeof(struct arducam_frame_meta)) {
+		v4l2_warn(&priv->sd, "embedded data too short: %ux%u\n",
+			  meta[0], meta[1]);
+		return;
 	}
 
-	return -EINVAL;
+	priv->meta_width = meta[0];
+	priv->meta_lines = meta[1];
 }
 
-static struct v4l2_ctrl *get_control(struct arducam *priv, u32 id) {
-	int index = 0;
-	while (priv->ctrls[index]) {
-		if (priv->ctrls[index]->id == id)
-			return priv->ctrls[index];
-		index++;
+/* Remember what the bridge reports for the mode just selected. */
+static void arducam_learn_mode(struct arducam *priv)
+{
+	struct arducam_resolution *res =
+		&priv->supported_formats[priv->current_format_idx]
+			.resolution_set[priv->current_resolution_idx];
+	struct v4l2_ctrl *ctrl;
+
+	ctrl = get_control(priv, V4L2_CID_ARDUCAM_FRAME_RATE);
+	if (ctrl) {
+		res->min_fps = ctrl->minimum;
+		res->max_fps = ctrl->maximum;
+		res->fps_step = ctrl->step;
 	}
-	return NULL;
+
+	ctrl = get_control(priv, V4L2_CID_PIXEL_RATE);
+	if (ctrl)
+		res->pixel_rate = ctrl->maximum;
+
+	arducam_update_link_freq(priv);
+	arducam_learn_metadata(priv);
 }
 
-static int update_control(struct arducam *priv, u32 id)
+/*
+ * Read the range the bridge currently reports for control id into
+ * range[]: min, max, step, def.
+ */
+static int arducam_read_ctrl_range(struct arducam *priv, u32 id, u32 *range)
 {
-	int ret = 0;
 	struct i2c_client *client = priv->client;
-	struct v4l2_ctrl *ctrl;
-	u32 min, max, step, def, id2;
+	u32 id2;
+	int ret, i;
+
+	/* The bridge may clamp the value to the new range */
+	arducam_ctrl_shadow_drop(priv, id);
 
 	arducam_write(client, CTRL_ID_REG, id);
 	arducam_read(client, CTRL_ID_REG, &id2);
@@ -717,23 +2224,57 @@ static int update_control(struct arducam *priv, u32 id)
 		__func__, id, id2);
 	arducam_write(client, CTRL_VALUE_REG, 0);
 	wait_for_free(client, 1);
-	ret += arducam_read(client, CTRL_MAX_REG, &max);
-	ret += arducam_read(client, CTRL_MIN_REG, &min);
-	ret += arducam_read(client, CTRL_DEF_REG, &def);
-	ret += arducam_read(client, CTRL_STEP_REG, &step);
+
+	/* CTRL_MIN_REG .. CTRL_DEF_REG are consecutive */
+	ret = arducam_read_block(client, CTRL_MIN_REG, range, 4);
 	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < 4; i++)
+		if (range[i] == NO_DATA_AVAILABLE)
+			return -EINVAL;
+
+	return 0;
+}
+
+static int update_control(struct arducam *priv, u32 id)
+{
+	struct v4l2_ctrl *ctrl;
+	u32 min, max, step, def;
+	u32 range[4];
+
+	ctrl = get_control(priv, id);
+	if (!ctrl)
+		return 0;
+
+	if (arducam_read_ctrl_range(priv, id, range))
 		goto err;
-	if (id == NO_DATA_AVAILABLE || max == NO_DATA_AVAILABLE ||
-		min == NO_DATA_AVAILABLE || def == NO_DATA_AVAILABLE ||
-		step == NO_DATA_AVAILABLE)
-		goto err;
+	min = range[0];
+	max = range[1];
+	step = range[2];
+	def = range[3];
 
 	v4l2_dbg(1, debug, priv->client,
 		 "%s: min: %d, max: %d, step: %d, def: %d\n",
 		 __func__, min, max, step, def);
-	ctrl = get_control(priv, id);
 	__v4l2_ctrl_modify_range(ctrl, min, max, step, def);
 
+	/*
+	 * Reading the range went through CTRL_VALUE_REG, which also sets the
+	 * control. Put the current value back on a live stream; when idle,
+	 * the next STREAMON sends it since the shadow was dropped.
+	 */
+	if (priv->streaming && !(ctrl->flags & V4L2_CTRL_FLAG_READ_ONLY)) {
+		struct reg_sequence seq[] = {
+			{ CTRL_ID_REG, id },
+			{ CTRL_VALUE_REG, ctrl->val },
+		};
+
+		return arducam_write_ctrl_seq(priv, seq, ARRAY_SIZE(seq));
+	}
+
+	return 0;
+
 err:
 	return -EINVAL;
 }
@@ -751,7 +2292,7 @@ static int update_controls(struct arducam *priv) {
 }
 
 
-static int arducam_csi2_set_fmt(struct v4l2_subdev *sd,
+static int __arducam_csi2_set_fmt(struct v4l2_subdev *sd,
 								struct v4l2_subdev_pad_config *cfg,
 								struct v4l2_subdev_format *format)
 {
@@ -770,46 +2311,53 @@ static int arducam_csi2_set_fmt(struct v4l2_subdev *sd,
 				__func__, format->format.code, format->format.width,
 					format->format.height);
 
+		mutex_lock(&priv->mutex);
+
 		i = arducam_csi2_get_fmt_idx_by_code(priv, format->format.code);
-		if (i < 0)
+		if (i < 0) {
+			mutex_unlock(&priv->mutex);
 			return -EINVAL;
+		}
+
+		/* Descriptor registers are mode dependent */
+		arducam_invalidate_cache(priv);
 
 		format->format.code = supported_formats[i].mbus_code;
 		// format->format.code = arducam_get_format_code(priv, format->format.code);
 
-		for (j = 0; j < supported_formats[i].num_resolution_set; j++) {
-			if (supported_formats[i].resolution_set[j].width 
-					== format->format.width && 
-				supported_formats[i].resolution_set[j].height
-					== format->format.height) {
-
-				v4l2_dbg(1, debug, sd, "%s: format match.\n", __func__);
-				v4l2_dbg(1, debug, sd, "%s: set format to device: %d %d.\n",
-					__func__, supported_formats[i].index, j);
-
-				arducam_write(priv->client, PIXFORMAT_INDEX_REG,
-					supported_formats[i].index);
-				arducam_write(priv->client, RESOLUTION_INDEX_REG, j);
-				
-				priv->current_format_idx = i;
-				priv->current_resolution_idx = j;
-
-				update_controls(priv);
-				return 0;
-			}
+		j = arducam_lookup_res(priv, i, format->format.width,
+				       format->format.height);
+		if (j >= 0) {
+			v4l2_dbg(1, debug, sd, "%s: format match.\n", __func__);
+		} else {
+			j = arducam_find_nearest_res(priv, i, format->format.width,
+						     format->format.height);
+			format->format.width =
+				supported_formats[i].resolution_set[j].width;
+			format->format.height =
+				supported_formats[i].resolution_set[j].height;
 		}
-		format->format.width = supported_formats[i].resolution_set[0].width;
-		format->format.height = supported_formats[i].resolution_set[0].height;
+
+		v4l2_dbg(1, debug, sd, "%s: set format to device: %d %d.\n",
+			__func__, supported_formats[i].index, j);
 
 		arducam_write(priv->client, PIXFORMAT_INDEX_REG,
 			supported_formats[i].index);
-		arducam_write(priv->client, RESOLUTION_INDEX_REG, 0);
+		arducam_write(priv->client, RESOLUTION_INDEX_REG, j);
 
 		priv->current_format_idx = i;
-		priv->current_resolution_idx = 0;
+		priv->current_resolution_idx = j;
+		/* Selecting a mode resets the readout window */
+		priv->crop_set = false;
+		trace_arducam_set_fmt(priv->client, format->format.code,
+			format->format.width, format->format.height, i, j);
 		update_controls(priv);
+		arducam_learn_mode(priv);
+		mutex_unlock(&priv->mutex);
 	} else {
-		arducam_update_metadata_pad_format(format);
+		mutex_lock(&priv->mutex);
+		arducam_update_metadata_pad_format(priv, format);
+		mutex_unlock(&priv->mutex);
 	}
 
 
@@ -822,6 +2370,12 @@ static int arducam_start_streaming(struct arducam *arducam)
 	struct i2c_client *client = v4l2_get_subdevdata(&arducam->sd);
 	int ret;
 
+	if (arducam->lanes_override) {
+		ret = arducam_write(client, MIPI_LANES_REG, arducam->lanes);
+		if (ret)
+			return ret;
+	}
+
 	/* set stream on register */
 	ret =  arducam_write_reg(arducam, arducam_REG_MODE_SELECT,
 				arducam_REG_VALUE_32BIT, arducam_MODE_STREAMING);
@@ -831,11 +2385,18 @@ static int arducam_start_streaming(struct arducam *arducam)
 
 	wait_for_free(client, 2);
 
-	arducam->wait_until_free = true;
-	/* Apply customized values from user */
+	/* Writes left over from the previous stream are covered below */
+	arducam_ctrl_queue_discard(arducam);
+
+	/* Apply customized values from user, as one batch */
+	arducam->ctrl_batching = true;
+	arducam->num_ctrl_batch = 0;
+
 	ret =  __v4l2_ctrl_handler_setup(arducam->sd.ctrl_handler);
+	if (!ret)
+		ret = arducam_flush_ctrl_batch(arducam);
 
-	arducam->wait_until_free = false;
+	arducam->ctrl_batching = false;
 	if (ret)
 		return ret;
 
@@ -846,20 +2407,41 @@ static int arducam_start_streaming(struct arducam *arducam)
 
 static int arducam_read_sel(struct arducam *arducam, struct v4l2_rect *rect) {
 	struct i2c_client *client = arducam->client;
+	u32 sel[4];
 	int ret = 0;
-	ret += arducam_read(client, IPC_SEL_TOP_REG, &rect->top);
-	ret += arducam_read(client, IPC_SEL_LEFT_REG, &rect->left);
-	ret += arducam_read(client, IPC_SEL_WIDTH_REG, &rect->width);
-	ret += arducam_read(client, IPC_SEL_HEIGHT_REG, &rect->height);
-
-	if (ret || rect->top == NO_DATA_AVAILABLE 
-		|| rect->left == NO_DATA_AVAILABLE 
-		|| rect->width == NO_DATA_AVAILABLE 
-		|| rect->height == NO_DATA_AVAILABLE) {
+
+	/* IPC_SEL_TOP_REG .. IPC_SEL_HEIGHT_REG are consecutive */
+	ret = arducam_read_block(client, IPC_SEL_TOP_REG, sel, ARRAY_SIZE(sel));
+
+	if (ret || sel[0] == NO_DATA_AVAILABLE 
+		|| sel[1] == NO_DATA_AVAILABLE 
+		|| sel[2] == NO_DATA_AVAILABLE 
+		|| sel[3] == NO_DATA_AVAILABLE) {
 			v4l2_err(client, "%s: Failed to read selection.\n",
 			 	 __func__);
 			return -EINVAL;
 		}
+	rect->top = sel[0];
+	rect->left = sel[1];
+	rect->width = sel[2];
+	rect->height = sel[3];
+	return 0;
+}
+
+/* Select the IPC window target, unless it is the one already selected */
+static int arducam_select_sel_target(struct arducam *arducam, u32 target)
+{
+	struct i2c_client *client = arducam->client;
+	int ret;
+
+	if (target == arducam->sel_target)
+		return 0;
+
+	ret = arducam_write(client, IPC_SEL_TARGET_REG, target);
+	if (ret)
+		return ret;
+
+	wait_for_free(client, 2);
 	return 0;
 }
 
@@ -881,47 +2463,284 @@ __arducam_get_pad_crop(struct arducam *arducam, struct v4l2_subdev_pad_config *c
 	return NULL;
 }
 
-static int arducam_get_selection(struct v4l2_subdev *sd,
-				struct v4l2_subdev_pad_config *cfg,
-				struct v4l2_subdev_selection *sel)
+static int __arducam_get_selection(struct v4l2_subdev *sd,
+				struct v4l2_subdev_pad_config *cfg,
+				struct v4l2_subdev_selection *sel)
+{
+	int ret = 0;
+	const struct v4l2_rect *crop;
+	struct v4l2_rect rect;
+	struct arducam *arducam = to_arducam(sd);
+	struct i2c_client *client = arducam->client;
+
+	/*
+	 * Target select and window read must not interleave with another
+	 * selection call, or the window is read or written on the wrong target.
+	 */
+	mutex_lock(&arducam->mutex);
+
+	/* The IPC window is cached for the last target written */
+	ret = arducam_select_sel_target(arducam, sel->target);
+	if (ret) {
+		v4l2_err(client, "%s: Write register 0x%02x failed\n",
+			 	 __func__, IPC_SEL_TARGET_REG);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	switch (sel->target) {
+	case V4L2_SEL_TGT_CROP:
+		crop = __arducam_get_pad_crop(arducam, cfg, sel->pad,
+					      sel->which);
+		if (crop)
+			sel->r = *crop;
+		else
+			ret = -EINVAL;
+		break;
+
+	case V4L2_SEL_TGT_NATIVE_SIZE:
+	case V4L2_SEL_TGT_CROP_DEFAULT:
+	case V4L2_SEL_TGT_CROP_BOUNDS:
+		ret = arducam_read_sel(arducam, &rect);
+		if (ret) {
+			ret = -EINVAL;
+			break;
+		}
+		sel->r = rect;
+		break;
+
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+out:
+	mutex_unlock(&arducam->mutex);
+
+	return ret;
+}
+
+/*
+ * Fit a crop request into the bounds, on the bridge's grid. Older
+ * firmware does not report a grid; keep Bayer quads intact there.
+ */
+static void arducam_align_crop(struct arducam *arducam,
+			       const struct v4l2_rect *bounds,
+			       struct v4l2_rect *r)
+{
+	u32 align, ha = 2, va = 2;
+
+	if (!arducam_read(arducam->client, IPC_SEL_ALIGN_REG, &align) &&
+	    align != NO_DATA_AVAILABLE && align) {
+		ha = max_t(u32, align & 0xffff, 1);
+		va = max_t(u32, align >> 16, 1);
+	}
+
+	r->width = clamp_t(u32, rounddown(r->width, ha), ha, bounds->width);
+	r->height = clamp_t(u32, rounddown(r->height, va), va, bounds->height);
+	r->left = clamp_t(s32, r->left, bounds->left,
+			  bounds->left + bounds->width - r->width);
+	r->top = clamp_t(s32, r->top, bounds->top,
+			 bounds->top + bounds->height - r->height);
+	r->left = bounds->left + rounddown(r->left - bounds->left, ha);
+	r->top = bounds->top + rounddown(r->top - bounds->top, va);
+}
+
+/* Program the readout window. Called with mutex held. */
+static int arducam_write_crop(struct arducam *arducam,
+			      const struct v4l2_rect *r)
+{
+	struct i2c_client *client = arducam->client;
+	u32 win[4];
+	int ret;
+
+	ret = arducam_select_sel_target(arducam, V4L2_SEL_TGT_CROP);
+	if (ret)
+		return ret;
+
+	/* IPC_SEL_TOP_REG .. IPC_SEL_HEIGHT_REG are consecutive */
+	win[0] = r->top;
+	win[1] = r->left;
+	win[2] = r->width;
+	win[3] = r->height;
+	ret = arducam_write_block(client, IPC_SEL_TOP_REG, win, ARRAY_SIZE(win));
+	if (ret)
+		return ret;
+	wait_for_free(client, 2);
+
+	return 0;
+}
+
+/*
+ * Move the readout window. The bridge reads out only the crop, so the
+ * pixel rate and blanking limits are read back and the image pad
+ * follows the crop size.
+ */
+static int __arducam_set_selection(struct v4l2_subdev *sd,
+				struct v4l2_subdev_pad_config *cfg,
+				struct v4l2_subdev_selection *sel)
+{
+	struct arducam *arducam = to_arducam(sd);
+	struct v4l2_mbus_framefmt *try_fmt;
+	struct v4l2_rect bounds;
+	int ret;
+
+	if (sel->pad != IMAGE_PAD || sel->target != V4L2_SEL_TGT_CROP)
+		return -EINVAL;
+
+	mutex_lock(&arducam->mutex);
+
+	if (arducam->streaming) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	ret = arducam_select_sel_target(arducam, V4L2_SEL_TGT_CROP_BOUNDS);
+	if (!ret)
+		ret = arducam_read_sel(arducam, &bounds);
+	if (ret)
+		goto out;
+
+	arducam_align_crop(arducam, &bounds, &sel->r);
+
+	if (sel->which == V4L2_SUBDEV_FORMAT_TRY) {
+		*v4l2_subdev_get_try_crop(sd, cfg, sel->pad) = sel->r;
+		try_fmt = v4l2_subdev_get_try_format(sd, cfg, sel->pad);
+		try_fmt->width = sel->r.width;
+		try_fmt->height = sel->r.height;
+		goto out;
+	}
+
+	ret = arducam_write_crop(arducam, &sel->r);
+	if (ret)
+		goto out;
+
+	ret = arducam_read_sel(arducam, &arducam->crop);
+	if (ret)
+		goto out;
+	sel->r = arducam->crop;
+	arducam->crop_set = true;
+
+	update_controls(arducam);
+	update_control(arducam, V4L2_CID_EXPOSURE);
+
+out:
+	mutex_unlock(&arducam->mutex);
+
+	return ret;
+}
+
+/* Record the current state in arducam->snapshot. Called with mutex held. */
+static void arducam_snapshot_take(struct arducam *arducam)
+{
+	struct arducam_snapshot *snap = &arducam->snapshot;
+	struct reg_sequence *seq = snap->seq;
+	struct v4l2_rect *crop = &arducam->crop;
+	struct v4l2_ctrl *ctrl;
+	int i, n = 0;
+
+	seq[n++] = (struct reg_sequence){ PIXFORMAT_INDEX_REG,
+		arducam->supported_formats[arducam->current_format_idx].index };
+	seq[n++] = (struct reg_sequence){ RESOLUTION_INDEX_REG,
+		arducam->current_resolution_idx };
+	if (arducam->crop_set) {
+		seq[n++] = (struct reg_sequence){ IPC_SEL_TARGET_REG,
+						  V4L2_SEL_TGT_CROP };
+		seq[n++] = (struct reg_sequence){ IPC_SEL_TOP_REG, crop->top };
+		seq[n++] = (struct reg_sequence){ IPC_SEL_LEFT_REG, crop->left };
+		seq[n++] = (struct reg_sequence){ IPC_SEL_WIDTH_REG, crop->width };
+		seq[n++] = (struct reg_sequence){ IPC_SEL_HEIGHT_REG, crop->height };
+	}
+	snap->num_mode = n;
+
+	for (i = 0; i < arducam->num_ctrl_descs; i++) {
+		ctrl = arducam->ctrl_entries[i].ctrl;
+		if (!ctrl || ctrl->flags & V4L2_CTRL_FLAG_READ_ONLY ||
+		    ctrl->val == ctrl->default_value)
+			continue;
+		seq[n++] = (struct reg_sequence){ CTRL_ID_REG, ctrl->id };
+		seq[n++] = (struct reg_sequence){ CTRL_VALUE_REG, ctrl->val };
+	}
+	snap->num_seq = n;
+}
+
+/* Check that the bridge took the mode and window of the snapshot */
+static int arducam_snapshot_verify(struct arducam *arducam)
+{
+	struct i2c_client *client = arducam->client;
+	struct v4l2_rect rect;
+	u32 pix, res;
+
+	if (arducam_read(client, PIXFORMAT_INDEX_REG, &pix) ||
+	    arducam_read(client, RESOLUTION_INDEX_REG, &res))
+		return -EIO;
+
+	if (pix != arducam->snapshot.seq[0].def ||
+	    res != arducam->snapshot.seq[1].def) {
+		v4l2_err(&arducam->sd, "restored mode %u/%u, bridge has %u/%u\n",
+			 arducam->snapshot.seq[0].def,
+			 arducam->snapshot.seq[1].def, pix, res);
+		return -EIO;
+	}
+
+	if (!arducam->crop_set)
+		return 0;
+
+	if (arducam_read_sel(arducam, &rect) ||
+	    rect.left != arducam->crop.left || rect.top != arducam->crop.top ||
+	    rect.width != arducam->crop.width ||
+	    rect.height != arducam->crop.height) {
+		v4l2_err(&arducam->sd, "restored crop does not match\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Replay the snapshot into a bridge that came back from reset with
+ * everything at its defaults: the mode and window as one transaction
+ * list, then the changed controls in barrier-delimited batches. Controls
+ * still at their default are primed in the shadow instead, so the
+ * handler setup in arducam_start_streaming() finds nothing left to send.
+ */
+static int arducam_snapshot_restore(struct arducam *arducam)
 {
-	int ret = 0;
-	struct v4l2_rect rect;
-	struct arducam *arducam = to_arducam(sd);
+	struct arducam_snapshot *snap = &arducam->snapshot;
 	struct i2c_client *client = arducam->client;
-	
-	ret = arducam_write(client, IPC_SEL_TARGET_REG, sel->target);
-	if (ret) {
-		v4l2_err(client, "%s: Write register 0x%02x failed\n",
-			 	 __func__, IPC_SEL_TARGET_REG);
-		return -EINVAL;
-	}
-
-	wait_for_free(client, 2);
+	struct v4l2_ctrl *ctrl;
+	int i, ret;
 
-	switch (sel->target) {
-	case V4L2_SEL_TGT_CROP: {
+	ret = arducam_write_seq(client, snap->seq, snap->num_mode);
+	if (ret)
+		return ret;
+	wait_for_free(client, 5);
 
-		mutex_lock(&arducam->mutex);
-		sel->r = *__arducam_get_pad_crop(arducam, cfg, sel->pad,
-						sel->which);
-		mutex_unlock(&arducam->mutex);
+	ret = arducam_snapshot_verify(arducam);
+	if (ret)
+		return ret;
 
-		return 0;
+	for (i = 0; i < arducam->num_ctrl_descs; i++) {
+		ctrl = arducam->ctrl_entries[i].ctrl;
+		if (ctrl && ctrl->val == ctrl->default_value)
+			arducam_ctrl_shadow_set(arducam, ctrl->id, ctrl->val);
 	}
 
-	case V4L2_SEL_TGT_NATIVE_SIZE:
-	case V4L2_SEL_TGT_CROP_DEFAULT:
-	case V4L2_SEL_TGT_CROP_BOUNDS:
-		ret = arducam_read_sel(arducam, &rect);
-		if (ret) {
-			return -EINVAL;
-		}
-		sel->r = rect;
-		return 0;
-	}
+	return arducam_write_ctrl_seq(arducam, snap->seq + snap->num_mode,
+				      snap->num_seq - snap->num_mode);
+}
 
-	return -EINVAL;
+/* Bring a bridge that was reset back to the driver's state */
+static int arducam_restore_state(struct arducam *arducam)
+{
+	int ret;
+
+	arducam_snapshot_take(arducam);
+	ret = arducam_snapshot_restore(arducam);
+	if (!ret)
+		arducam->restore_pending = false;
+
+	return ret;
 }
 
 /* Stop streaming */
@@ -943,12 +2762,157 @@ static int arducam_stop_streaming(struct arducam *arducam)
 	return 0;
 }
 
-static int arducam_set_stream(struct v4l2_subdev *sd, int enable)
+static LIST_HEAD(arducam_sync_groups);
+static DEFINE_MUTEX(arducam_sync_lock);
+
+static const char * const arducam_sync_role_names[] = {
+	[ARDUCAM_SYNC_NONE] = "none",
+	[ARDUCAM_SYNC_MASTER] = "master",
+	[ARDUCAM_SYNC_SLAVE] = "slave",
+};
+
+static void __arducam_sync_leave(struct arducam *arducam)
+{
+	struct arducam_sync_group *group = arducam->sync_group;
+
+	if (!group)
+		return;
+
+	if (arducam->sync_role == ARDUCAM_SYNC_MASTER)
+		group->has_master = false;
+
+	list_del(&arducam->sync_node);
+	if (list_empty(&group->members)) {
+		list_del(&group->list);
+		kfree(group);
+	}
+
+	arducam->sync_group = NULL;
+	arducam->sync_role = ARDUCAM_SYNC_NONE;
+}
+
+/*
+ * Move to group id with the given role; ARDUCAM_SYNC_NONE leaves.
+ * Called with arducam_sync_lock held.
+ */
+static int __arducam_sync_join(struct arducam *arducam, u32 id,
+			       enum arducam_sync_role role)
+{
+	struct arducam_sync_group *group;
+
+	__arducam_sync_leave(arducam);
+	if (role == ARDUCAM_SYNC_NONE)
+		return 0;
+
+	list_for_each_entry(group, &arducam_sync_groups, list)
+		if (group->id == id)
+			goto found;
+
+	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	if (!group)
+		return -ENOMEM;
+	group->id = id;
+	INIT_LIST_HEAD(&group->members);
+	list_add_tail(&group->list, &arducam_sync_groups);
+
+found:
+	if (role == ARDUCAM_SYNC_MASTER) {
+		if (group->has_master)
+			return -EBUSY;
+		group->has_master = true;
+	}
+
+	list_add_tail(&arducam->sync_node, &group->members);
+	arducam->sync_group = group;
+	arducam->sync_role = role;
+
+	return 0;
+}
+
+static int arducam_sync_join(struct arducam *arducam, u32 id,
+			     enum arducam_sync_role role)
+{
+	int ret;
+
+	mutex_lock(&arducam_sync_lock);
+	ret = __arducam_sync_join(arducam, id, role);
+	mutex_unlock(&arducam_sync_lock);
+
+	return ret;
+}
+
+/*
+ * An idle slave is powered down and would miss the first trigger edges,
+ * so a master only starts once every slave of its group is streaming and
+ * waiting for the trigger. Called before the master takes its own mutex.
+ */
+static int arducam_sync_check_slaves(struct arducam *master)
+{
+	struct arducam_sync_group *group;
+	struct arducam *member;
+	bool streaming;
+	int ret = 0;
+
+	mutex_lock(&arducam_sync_lock);
+	group = master->sync_group;
+	if (!group || master->sync_role != ARDUCAM_SYNC_MASTER)
+		goto out;
+
+	list_for_each_entry(member, &group->members, sync_node) {
+		if (member->sync_role != ARDUCAM_SYNC_SLAVE)
+			continue;
+
+		mutex_lock(&member->mutex);
+		streaming = member->streaming;
+		mutex_unlock(&member->mutex);
+		if (!streaming) {
+			v4l2_warn(&master->sd, "sync group %u: %s is not streaming\n",
+				  group->id, dev_name(&member->client->dev));
+			ret = -EAGAIN;
+			break;
+		}
+	}
+
+out:
+	mutex_unlock(&arducam_sync_lock);
+
+	return ret;
+}
+
+/* Put the bridge in the trigger mode of its role */
+static int arducam_sync_prepare(struct arducam *arducam)
+{
+	struct arducam_sync_group *group = arducam->sync_group;
+	struct v4l2_ctrl *ctrl;
+	int ret;
+
+	if (!group)
+		return 0;
+
+	ctrl = get_control(arducam, V4L2_CID_ARDUCAM_EXT_TRI);
+	if (!ctrl) {
+		v4l2_err(&arducam->sd, "sync group %u: no trigger mode\n",
+			 group->id);
+		return -EOPNOTSUPP;
+	}
+
+	return __v4l2_ctrl_s_ctrl(ctrl, arducam->sync_role == ARDUCAM_SYNC_SLAVE);
+}
+
+static int __arducam_set_stream(struct v4l2_subdev *sd, int enable)
 {
 	struct arducam *arducam = to_arducam(sd);
 	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	ktime_t start = ktime_get();
 	int ret = 0;
 
+	/* A master's slaves must be waiting before its trigger starts */
+	if (enable) {
+		ret = arducam_sync_check_slaves(arducam);
+		if (ret)
+			return ret;
+	}
+
 	mutex_lock(&arducam->mutex);
 	if (arducam->streaming == enable) {
 		mutex_unlock(&arducam->mutex);
@@ -962,6 +2926,16 @@ static int arducam_set_stream(struct v4l2_subdev *sd, int enable)
 			goto err_unlock;
 		}
 
+		if (arducam->restore_pending) {
+			ret = arducam_restore_state(arducam);
+			if (ret)
+				goto err_rpm_put;
+		}
+
+		ret = arducam_sync_prepare(arducam);
+		if (ret)
+			goto err_rpm_put;
+
 		/*
 		 * Apply default & customized values
 		 * and then start streaming.
@@ -971,7 +2945,9 @@ static int arducam_set_stream(struct v4l2_subdev *sd, int enable)
 			goto err_rpm_put;
 	} else {
 		arducam_stop_streaming(arducam);
-		pm_runtime_put(&client->dev);
+		/* Stay powered for a quick restart, see autosuspend_delay_ms */
+		pm_runtime_mark_last_busy(&client->dev);
+		pm_runtime_put_autosuspend(&client->dev);
 	}
 
 	arducam->streaming = enable;
@@ -981,6 +2957,13 @@ static int arducam_set_stream(struct v4l2_subdev *sd, int enable)
 	__v4l2_ctrl_grab(arducam->hflip, enable);
 
 	mutex_unlock(&arducam->mutex);
+	trace_arducam_stream(client, enable, ret);
+
+	spin_lock(&arducam->stats_lock);
+	arducam_hist_add(enable ? &arducam->stats.stream_on_hist :
+				  &arducam->stats.stream_off_hist,
+			 ktime_us_delta(ktime_get(), start));
+	spin_unlock(&arducam->stats_lock);
 
 	return ret;
 
@@ -988,6 +2971,7 @@ err_rpm_put:
 	pm_runtime_put(&client->dev);
 err_unlock:
 	mutex_unlock(&arducam->mutex);
+	trace_arducam_stream(client, enable, ret);
 
 	return ret;
 }
@@ -998,30 +2982,48 @@ static int __maybe_unused arducam_suspend(struct device *dev)
 	struct v4l2_subdev *sd = i2c_get_clientdata(client);
 	struct arducam *arducam = to_arducam(sd);
 
+	mutex_lock(&arducam->mutex);
 	if (arducam->streaming)
 		arducam_stop_streaming(arducam);
+	arducam_snapshot_take(arducam);
+	mutex_unlock(&arducam->mutex);
 
 	return 0;
 }
 
+/*
+ * The bridge may or may not have kept its state over the sleep. Replay
+ * the snapshot taken at suspend, which verifies the mode, before the
+ * stream is restarted; an idle bridge is restored on the next STREAMON.
+ */
 static int __maybe_unused arducam_resume(struct device *dev)
 {
 	struct i2c_client *client = to_i2c_client(dev);
 	struct v4l2_subdev *sd = i2c_get_clientdata(client);
 	struct arducam *arducam = to_arducam(sd);
-	int ret;
+	int ret = 0;
 
-	if (arducam->streaming) {
-		ret = arducam_start_streaming(arducam);
-		if (ret)
-			goto error;
+	mutex_lock(&arducam->mutex);
+	if (!arducam->streaming) {
+		arducam->restore_pending = true;
+		goto out;
 	}
 
+	arducam_invalidate_cache(arducam);
+	ret = arducam_snapshot_restore(arducam);
+	if (!ret)
+		ret = arducam_start_streaming(arducam);
+	if (ret)
+		goto error;
+
+out:
+	mutex_unlock(&arducam->mutex);
 	return 0;
 
 error:
 	arducam_stop_streaming(arducam);
 	arducam->streaming = 0;
+	mutex_unlock(&arducam->mutex);
 	return ret;
 }
 
@@ -1038,12 +3040,374 @@ static int arducam_get_regulators(struct arducam *arducam)
 				       arducam->supplies);
 }
 
+static int arducam_log_status(struct v4l2_subdev *sd)
+{
+	struct arducam *arducam = to_arducam(sd);
+	struct arducam_wait_stats *stats = &arducam->wait_stats;
+
+	v4l2_info(sd, "idle wait: %s, %u waits, %u polls, %u timeouts\n",
+		  arducam->ready_irq > 0 ? "interrupt" : "polling",
+		  stats->count, stats->polls, stats->timeouts);
+	v4l2_info(sd, "idle wait: last %u us, max %u us, avg %llu us\n",
+		  stats->last_us, stats->max_us,
+		  stats->count ? div_u64(stats->total_us, stats->count) : 0);
+
+	return v4l2_ctrl_subdev_log_status(sd);
+}
+
+static void arducam_hist_show(struct seq_file *m, const char *name,
+			      const struct arducam_hist *hist)
+{
+	int i, last = -1;
+
+	for (i = 0; i < ARDUCAM_HIST_BUCKETS; i++)
+		if (hist->bucket[i])
+			last = i;
+
+	seq_printf(m, "%-16s", name);
+	for (i = 0; i <= last; i++)
+		seq_printf(m, " %u", hist->bucket[i]);
+	seq_putc(m, '\n');
+}
+
+static int arducam_stats_show(struct seq_file *m, void *data)
+{
+	static const char * const block_names[ARDUCAM_REG_BLOCKS] = {
+		[DEVICE_REG_BASE >> 8] = "device",
+		[PIXFORMAT_REG_BASE >> 8] = "pixformat",
+		[FORMAT_REG_BASE >> 8] = "format",
+		[CTRL_REG_BASE >> 8] = "ctrl",
+		[IPC_REG_BASE >> 8] = "ipc",
+		[DESC_REG_BASE >> 8] = "desc",
+		[DESC_WINDOW_BASE >> 8] = "desc-window",
+	};
+	static const char * const latency_names[NUM_ARDUCAM_LATENCIES] = {
+		[ARDUCAM_LATENCY_FAST] = "fast",
+		[ARDUCAM_LATENCY_SETTLE] = "settle",
+		[ARDUCAM_LATENCY_RECONFIG] = "reconfig",
+	};
+	struct arducam *priv = m->private;
+	struct arducam_wait_stats *wait = &priv->wait_stats;
+	struct arducam_xfer_stats *xfer;
+	struct arducam_ctrl_entry *entry;
+	struct arducam_ctrl_stats *ctrl;
+	int i;
+
+	spin_lock(&priv->stats_lock);
+
+	seq_puts(m, "# histograms: counts per bucket, bucket n < 2^n us\n");
+	seq_printf(m, "%-12s %10s %10s %10s %8s %8s\n",
+		   "block", "reads", "writes", "regs", "retries", "failures");
+	for (i = 0; i < ARDUCAM_REG_BLOCKS; i++) {
+		xfer = &priv->stats.xfer[i];
+		if (!xfer->reads && !xfer->writes)
+			continue;
+		seq_printf(m, "%-12s %10u %10u %10u %8u %8u\n",
+			   block_names[i] ? block_names[i] : "unknown",
+			   xfer->reads, xfer->writes, xfer->regs,
+			   xfer->retries, xfer->failures);
+	}
+	for (i = 0; i < ARDUCAM_REG_BLOCKS; i++) {
+		xfer = &priv->stats.xfer[i];
+		if (xfer->reads || xfer->writes)
+			arducam_hist_show(m, block_names[i] ? block_names[i] :
+					  "unknown", &xfer->hist);
+	}
+
+	seq_printf(m, "\nidle wait: %u waits, %u polls, %u timeouts, max %u us, avg %llu us\n",
+		   wait->count, wait->polls, wait->timeouts, wait->max_us,
+		   wait->count ? div_u64(wait->total_us, wait->count) : 0);
+	arducam_hist_show(m, "wait", &priv->stats.wait_hist);
+
+	seq_printf(m, "\n%-12s %10s %10s %10s %8s %8s\n",
+		   "ctrl", "count", "avg_us", "max_us", "class", "volatile");
+	for (i = 0; priv->ctrl_entries && i < priv->num_ctrl_descs; i++) {
+		entry = &priv->ctrl_entries[i];
+		ctrl = &entry->stats;
+		if (!ctrl->count)
+			continue;
+		seq_printf(m, "0x%08x   %10u %10llu %10u %8s %8s\n",
+			   entry->id, ctrl->count,
+			   div_u64(ctrl->total_us, ctrl->count), ctrl->max_us,
+			   latency_names[entry->latency_class],
+			   entry->auto_ctrl &&
+			   arducam_ctrl_auto_on(entry->auto_ctrl,
+						entry->auto_ctrl->cur.val) ?
+			   "yes" : "no");
+	}
+	arducam_hist_show(m, "s_ctrl", &priv->stats.ctrl_hist);
+
+	seq_putc(m, '\n');
+	arducam_hist_show(m, "stream_on", &priv->stats.stream_on_hist);
+	arducam_hist_show(m, "stream_off", &priv->stats.stream_off_hist);
+
+	spin_unlock(&priv->stats_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(arducam_stats);
+
+static int arducam_ops_show(struct seq_file *m, void *data)
+{
+	static const char * const op_names[NUM_ARDUCAM_OPS] = {
+		[ARDUCAM_OP_ENUM_MBUS_CODE] = "enum_mbus_code",
+		[ARDUCAM_OP_GET_FMT] = "get_fmt",
+		[ARDUCAM_OP_SET_FMT] = "set_fmt",
+		[ARDUCAM_OP_ENUM_FRAME_SIZE] = "enum_frame_size",
+		[ARDUCAM_OP_GET_SELECTION] = "get_selection",
+		[ARDUCAM_OP_SET_SELECTION] = "set_selection",
+		[ARDUCAM_OP_ENUM_FRAME_INTERVAL] = "enum_frame_interval",
+		[ARDUCAM_OP_S_STREAM] = "s_stream",
+		[ARDUCAM_OP_S_CTRL] = "s_ctrl",
+	};
+	struct arducam *priv = m->private;
+	struct arducam_op_stats *op;
+	int i;
+
+	spin_lock(&priv->stats_lock);
+
+	/* Per call averages; busy is the time not spent waiting for idle */
+	seq_printf(m, "%-16s %8s %10s %10s %10s %10s %10s\n", "op", "calls",
+		   "xfers", "regs", "avg_us", "busy_us", "max_us");
+	for (i = 0; i < NUM_ARDUCAM_OPS; i++) {
+		op = &priv->stats.op[i];
+		if (!op->calls)
+			continue;
+		seq_printf(m, "%-16s %8u %10llu %10llu %10llu %10llu %10llu\n",
+			   op_names[i], op->calls,
+			   div_u64(op->xfers, op->calls),
+			   div_u64(op->regs, op->calls),
+			   div64_u64(op->total_ns, (u64)op->calls * NSEC_PER_USEC),
+			   div64_u64(op->total_ns - min(op->wait_ns, op->total_ns),
+				     (u64)op->calls * NSEC_PER_USEC),
+			   div_u64(op->max_ns, NSEC_PER_USEC));
+	}
+
+	spin_unlock(&priv->stats_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(arducam_ops);
+
+static ssize_t arducam_stats_reset_write(struct file *file,
+					 const char __user *buf,
+					 size_t count, loff_t *ppos)
+{
+	struct arducam *priv = file->private_data;
+	int i;
+
+	spin_lock(&priv->stats_lock);
+	memset(&priv->wait_stats, 0, sizeof(priv->wait_stats));
+	memset(&priv->stats, 0, sizeof(priv->stats));
+	for (i = 0; priv->ctrl_entries && i < priv->num_ctrl_descs; i++)
+		memset(&priv->ctrl_entries[i].stats, 0,
+		       sizeof(priv->ctrl_entries[i].stats));
+	spin_unlock(&priv->stats_lock);
+
+	return count;
+}
+
+static const struct file_operations arducam_stats_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = arducam_stats_reset_write,
+	.llseek = no_llseek,
+};
+
+static void arducam_debugfs_init(struct arducam *priv)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "arducam-%s", dev_name(&priv->client->dev));
+	priv->debugfs = debugfs_create_dir(name, NULL);
+	debugfs_create_file("stats", 0444, priv->debugfs, priv,
+			    &arducam_stats_fops);
+	debugfs_create_file("ops", 0444, priv->debugfs, priv,
+			    &arducam_ops_fops);
+	debugfs_create_file("reset", 0200, priv->debugfs, priv,
+			    &arducam_stats_reset_fops);
+}
+
+/*
+ * Frame intervals of a mode, fastest first, one per frame rate step.
+ * Only modes that have been selected before are known: probing another
+ * mode would make the bridge drop its crop and control settings.
+ */
+static int __arducam_enum_frame_interval(struct v4l2_subdev *sd,
+				struct v4l2_subdev_pad_config *cfg,
+				struct v4l2_subdev_frame_interval_enum *fie)
+{
+	struct arducam *priv = to_arducam(sd);
+	struct arducam_resolution *res;
+	int i, j, ret = 0;
+	u32 fps;
+
+	if (fie->pad != IMAGE_PAD ||
+	    !get_control(priv, V4L2_CID_ARDUCAM_FRAME_RATE))
+		return -EINVAL;
+
+	mutex_lock(&priv->mutex);
+
+	i = arducam_lookup_code(priv, fie->code, true);
+	j = i < 0 ? -EINVAL :
+		arducam_lookup_res(priv, i, fie->width, fie->height);
+	if (j < 0) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	res = &priv->supported_formats[i].resolution_set[j];
+	if (!res->max_fps) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	fps = res->max_fps - fie->index * res->fps_step;
+	if (fie->index > (res->max_fps - res->min_fps) / res->fps_step ||
+	    !fps) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	fie->interval.numerator = 1;
+	fie->interval.denominator = fps;
+
+out:
+	mutex_unlock(&priv->mutex);
+
+	return ret;
+}
+
+static int arducam_g_frame_interval(struct v4l2_subdev *sd,
+				    struct v4l2_subdev_frame_interval *fi)
+{
+	struct arducam *priv = to_arducam(sd);
+	struct v4l2_ctrl *ctrl = get_control(priv, V4L2_CID_ARDUCAM_FRAME_RATE);
+
+	if (!ctrl || fi->pad != IMAGE_PAD)
+		return -EINVAL;
+
+	mutex_lock(&priv->mutex);
+	fi->interval.numerator = 1;
+	fi->interval.denominator = ctrl->val;
+	mutex_unlock(&priv->mutex);
+
+	return 0;
+}
+
+/*
+ * Set the frame rate closest to the interval within the current mode's
+ * range. The bridge derives the VBLANK and exposure limits from it, so
+ * their ranges are read back once the new rate has been applied.
+ */
+static int arducam_s_frame_interval(struct v4l2_subdev *sd,
+				    struct v4l2_subdev_frame_interval *fi)
+{
+	struct arducam *priv = to_arducam(sd);
+	struct v4l2_ctrl *ctrl = get_control(priv, V4L2_CID_ARDUCAM_FRAME_RATE);
+	u32 fps;
+	int ret;
+
+	if (!ctrl || fi->pad != IMAGE_PAD)
+		return -EINVAL;
+
+	mutex_lock(&priv->mutex);
+
+	if (fi->interval.numerator)
+		fps = DIV_ROUND_CLOSEST(fi->interval.denominator,
+					fi->interval.numerator);
+	else
+		fps = ctrl->maximum;
+	fps = clamp_t(u32, fps, ctrl->minimum, ctrl->maximum);
+
+	ret = __v4l2_ctrl_s_ctrl(ctrl, fps);
+	if (!ret && priv->streaming)
+		ret = arducam_ctrl_queue_flush(priv);
+	if (!ret) {
+		update_control(priv, V4L2_CID_VBLANK);
+		update_control(priv, V4L2_CID_EXPOSURE);
+	}
+
+	fi->interval.numerator = 1;
+	fi->interval.denominator = ctrl->val;
+
+	mutex_unlock(&priv->mutex);
+
+	return ret;
+}
+
+static int arducam_get_mbus_config(struct v4l2_subdev *sd, unsigned int pad,
+				   struct v4l2_mbus_config *config)
+{
+	struct arducam *priv = to_arducam(sd);
+
+	if (pad != IMAGE_PAD || priv->lanes < 1 || priv->lanes > 4)
+		return -EINVAL;
+
+	config->type = V4L2_MBUS_CSI2_DPHY;
+	config->flags = (V4L2_MBUS_CSI2_1_LANE << (priv->lanes - 1)) |
+			V4L2_MBUS_CSI2_CHANNEL_0;
+	if (priv->ep.bus.mipi_csi2.flags & V4L2_MBUS_CSI2_NONCONTINUOUS_CLOCK)
+		config->flags |= V4L2_MBUS_CSI2_NONCONTINUOUS_CLOCK;
+	else
+		config->flags |= V4L2_MBUS_CSI2_CONTINUOUS_CLOCK;
+
+	return 0;
+}
+
+/* Accounted entry points, see arducam_op_begin() */
+#define ARDUCAM_PAD_OP(name, op, type)					\
+static int name(struct v4l2_subdev *sd,				\
+		struct v4l2_subdev_pad_config *cfg, type *arg)		\
+{									\
+	struct arducam *priv = to_arducam(sd);				\
+	struct arducam_op_ctx ctx;					\
+	int ret;							\
+									\
+	arducam_op_begin(priv, &ctx);					\
+	ret = __##name(sd, cfg, arg);					\
+	arducam_op_end(priv, op, &ctx);					\
+									\
+	return ret;							\
+}
+
+ARDUCAM_PAD_OP(arducam_csi2_enum_mbus_code, ARDUCAM_OP_ENUM_MBUS_CODE,
+	       struct v4l2_subdev_mbus_code_enum)
+ARDUCAM_PAD_OP(arducam_csi2_get_fmt, ARDUCAM_OP_GET_FMT,
+	       struct v4l2_subdev_format)
+ARDUCAM_PAD_OP(arducam_csi2_set_fmt, ARDUCAM_OP_SET_FMT,
+	       struct v4l2_subdev_format)
+ARDUCAM_PAD_OP(arducam_csi2_enum_framesizes, ARDUCAM_OP_ENUM_FRAME_SIZE,
+	       struct v4l2_subdev_frame_size_enum)
+ARDUCAM_PAD_OP(arducam_get_selection, ARDUCAM_OP_GET_SELECTION,
+	       struct v4l2_subdev_selection)
+ARDUCAM_PAD_OP(arducam_set_selection, ARDUCAM_OP_SET_SELECTION,
+	       struct v4l2_subdev_selection)
+ARDUCAM_PAD_OP(arducam_enum_frame_interval, ARDUCAM_OP_ENUM_FRAME_INTERVAL,
+	       struct v4l2_subdev_frame_interval_enum)
+
+static int arducam_set_stream(struct v4l2_subdev *sd, int enable)
+{
+	struct arducam *priv = to_arducam(sd);
+	struct arducam_op_ctx ctx;
+	int ret;
+
+	arducam_op_begin(priv, &ctx);
+	ret = __arducam_set_stream(sd, enable);
+	arducam_op_end(priv, ARDUCAM_OP_S_STREAM, &ctx);
+
+	return ret;
+}
+
 static const struct v4l2_subdev_core_ops arducam_core_ops = {
 	// .s_power = arducam_s_power,
+	.log_status = arducam_log_status,
 };
 
 static const struct v4l2_subdev_video_ops arducam_video_ops = {
 	.s_stream = arducam_set_stream,
+	.g_frame_interval = arducam_g_frame_interval,
+	.s_frame_interval = arducam_s_frame_interval,
 };
 
 static const struct v4l2_subdev_pad_ops arducam_pad_ops = {
@@ -1052,6 +3416,9 @@ static const struct v4l2_subdev_pad_ops arducam_pad_ops = {
 	.set_fmt = arducam_csi2_set_fmt,
 	.enum_frame_size = arducam_csi2_enum_framesizes,
 	.get_selection = arducam_get_selection,
+	.set_selection = arducam_set_selection,
+	.enum_frame_interval = arducam_enum_frame_interval,
+	.get_mbus_config = arducam_get_mbus_config,
 };
 
 static const struct v4l2_subdev_ops arducam_subdev_ops = {
@@ -1066,8 +3433,11 @@ static const struct v4l2_subdev_internal_ops arducam_internal_ops = {
 
 static void arducam_free_controls(struct arducam *arducam)
 {
+	cancel_work_sync(&arducam->ctrl_work);
+	arducam_ctrl_queue_discard(arducam);
 	v4l2_ctrl_handler_free(arducam->sd.ctrl_handler);
 	mutex_destroy(&arducam->mutex);
+	mutex_destroy(&arducam->reg_lock);
 }
 
 static int arducam_get_length_of_set(struct i2c_client *client,
@@ -1183,11 +3553,35 @@ static u32 data_type_to_mbus_code(int data_type, int bayer_order)
 	}
 	return 0;
 }
+
+static int arducam_data_type_bpp(int data_type)
+{
+	switch (data_type) {
+	case IMAGE_DT_RAW6:
+		return 6;
+	case IMAGE_DT_RAW7:
+		return 7;
+	case IMAGE_DT_RAW8:
+		return 8;
+	case IMAGE_DT_RAW10:
+		return 10;
+	case IMAGE_DT_RAW12:
+		return 12;
+	case IMAGE_DT_RAW14:
+		return 14;
+	case IMAGE_DT_YUV422_10:
+		return 20;
+	case IMAGE_DT_RGB888:
+		return 24;
+	}
+	return 16;
+}
 static int arducam_enum_resolution(struct i2c_client *client,
 								struct arducam_format *format)
 {
 	int index = 0;
 	u32 width, height;
+	u32 size[2];
 	int num_resolution = 0;
 	int ret;
 	
@@ -1200,12 +3594,15 @@ static int arducam_enum_resolution(struct i2c_client *client,
 			sizeof(*(format->resolution_set)) * num_resolution, GFP_KERNEL);
 	while (1) {
 		ret = arducam_write(client, RESOLUTION_INDEX_REG, index);
-		ret += arducam_read(client, FORMAT_WIDTH_REG, &width);
-		ret += arducam_read(client, FORMAT_HEIGHT_REG, &height);
+		ret += arducam_read_block(client, FORMAT_WIDTH_REG,
+					size, ARRAY_SIZE(size));
 
 		if (ret < 0)
 			goto err;
 
+		width = size[0];
+		height = size[1];
+
 		if (width == NO_DATA_AVAILABLE || height == NO_DATA_AVAILABLE)
 			break;
 
@@ -1263,6 +3660,7 @@ static int arducam_enum_pixformat(struct arducam *priv)
 	int lanes;
 	int index = 0;
 	int num_pixformat = 0;
+	u32 desc[3];
 	struct i2c_client *client = priv->client;
 
 	num_pixformat = arducam_get_length_of_set(client,
@@ -1285,18 +3683,21 @@ static int arducam_enum_pixformat(struct arducam *priv)
 
 	while (1) {
 		ret = arducam_write(client, PIXFORMAT_INDEX_REG, index);
-		ret += arducam_read(client, PIXFORMAT_TYPE_REG, &pixformat_type);
+		/* PIXFORMAT_TYPE_REG, PIXFORMAT_ORDER_REG, MIPI_LANES_REG */
+		ret += arducam_read_block(client, PIXFORMAT_TYPE_REG,
+					desc, ARRAY_SIZE(desc));
+		if (ret < 0)
+			goto err;
 
+		pixformat_type = desc[0];
 		if (pixformat_type == NO_DATA_AVAILABLE)
 			break;
 
-		ret += arducam_read(client, MIPI_LANES_REG, &lanes);
+		lanes = desc[2];
 		if (lanes == NO_DATA_AVAILABLE)
 			break;
 
-		ret += arducam_read(client, PIXFORMAT_ORDER_REG, &bayer_order);
-		if (ret < 0)
-			goto err;
+		bayer_order = desc[1];
 
 		mbus_code = data_type_to_mbus_code(pixformat_type, bayer_order);
 		priv->supported_formats[index].index = index;
@@ -1427,11 +3828,8 @@ static int arducam_enum_controls(struct arducam *priv)
 	int ret;
 	int index = 0;
 	int num_ctrls = 0;
-	struct v4l2_ctrl_handler *ctrl_hdlr;
-	struct v4l2_fwnode_device_properties props;
-	u32 id, min, max, def, step;
+	u32 desc[5];
 	struct i2c_client *client;
-	ctrl_hdlr = &priv->ctrl_handler;
 	client = priv->client;
 	num_ctrls = arducam_get_length_of_set(client,
 					CTRL_INDEX_REG, CTRL_ID_REG);
@@ -1439,65 +3837,231 @@ static int arducam_enum_controls(struct arducam *priv)
 		goto err;
     v4l2_dbg(1, debug, priv->client, "%s: num_ctrls = %d\n",
 				__func__,num_ctrls);
-	ret = v4l2_ctrl_handler_init(ctrl_hdlr, num_ctrls);
-	if(ret)
-		return ret;
+
+	priv->ctrl_descs = devm_kcalloc(&client->dev, num_ctrls,
+				sizeof(*priv->ctrl_descs), GFP_KERNEL);
+	if (num_ctrls && !priv->ctrl_descs)
+		return -ENOMEM;
 
 	index = 0;
-	while (1) {
+	while (index < num_ctrls) {
 		ret = arducam_write(client, CTRL_INDEX_REG, index);
 		arducam_write(client, CTRL_VALUE_REG, 0);
 		wait_for_free(client, 1);
 
-		ret += arducam_read(client, CTRL_ID_REG, &id);
-		ret += arducam_read(client, CTRL_MAX_REG, &max);
-		ret += arducam_read(client, CTRL_MIN_REG, &min);
-		ret += arducam_read(client, CTRL_DEF_REG, &def);
-		ret += arducam_read(client, CTRL_STEP_REG, &step);
+		/* CTRL_ID_REG .. CTRL_DEF_REG are consecutive */
+		ret += arducam_read_block(client, CTRL_ID_REG,
+					desc, ARRAY_SIZE(desc));
 		if (ret < 0)
 			goto err;
-		if (id == NO_DATA_AVAILABLE || max == NO_DATA_AVAILABLE ||
-			min == NO_DATA_AVAILABLE || def == NO_DATA_AVAILABLE ||
-			step == NO_DATA_AVAILABLE)
+
+		if (desc[0] == NO_DATA_AVAILABLE || desc[1] == NO_DATA_AVAILABLE ||
+			desc[2] == NO_DATA_AVAILABLE || desc[3] == NO_DATA_AVAILABLE ||
+			desc[4] == NO_DATA_AVAILABLE)
 			break;
 
+		priv->ctrl_descs[index].id = desc[0];
+		priv->ctrl_descs[index].min = desc[1];
+		priv->ctrl_descs[index].max = desc[2];
+		priv->ctrl_descs[index].step = desc[3];
+		priv->ctrl_descs[index].def = desc[4];
+		if (arducam_read(client, CTRL_LATENCY_REG,
+				 &priv->ctrl_descs[index].latency))
+			priv->ctrl_descs[index].latency = NO_DATA_AVAILABLE;
+
+		index++;
+	}
+	priv->num_ctrl_descs = index;
+	
+	arducam_write(client, CTRL_INDEX_REG, 0);
+
+	return 0;
+err:
+	return -ENODEV;
+}
+
+/* Blocks until every queued control write has reached the bridge */
+static const struct v4l2_ctrl_config arducam_sync_flush_ctrl = {
+	.ops = &arducam_ctrl_ops,
+	.id = V4L2_CID_ARDUCAM_SYNC_FLUSH,
+	.name = "Control Sync Flush",
+	.type = V4L2_CTRL_TYPE_BUTTON,
+	.flags = V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+};
+
+/* Frame the last group of exposure/gain/frame rate writes landed on */
+static const struct v4l2_ctrl_config arducam_applied_frame_ctrl = {
+	.ops = &arducam_ctrl_ops,
+	.id = V4L2_CID_ARDUCAM_APPLIED_FRAME,
+	.name = "Controls Applied Frame",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+	.min = 0,
+	.max = INT_MAX,
+	.step = 1,
+};
+
+/* Frame currently being sent by the bridge */
+static const struct v4l2_ctrl_config arducam_frame_count_ctrl = {
+	.ops = &arducam_ctrl_ops,
+	.id = V4L2_CID_ARDUCAM_FRAME_COUNT,
+	.name = "Frame Count",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+	.min = 0,
+	.max = INT_MAX,
+	.step = 1,
+};
+
+/* The auto mode control that adjusts control id, or 0 */
+static u32 arducam_ctrl_auto_id(u32 id)
+{
+	u32 auto_id;
+
+	switch (id) {
+	case V4L2_CID_EXPOSURE:
+	case V4L2_CID_EXPOSURE_ABSOLUTE:
+		auto_id = V4L2_CID_EXPOSURE_AUTO;
+		break;
+	case V4L2_CID_GAIN:
+	case V4L2_CID_ANALOGUE_GAIN:
+		auto_id = V4L2_CID_AUTOGAIN;
+		break;
+	case V4L2_CID_FOCUS_ABSOLUTE:
+		auto_id = V4L2_CID_FOCUS_AUTO;
+		break;
+	case V4L2_CID_WHITE_BALANCE_TEMPERATURE:
+	case V4L2_CID_RED_BALANCE:
+	case V4L2_CID_BLUE_BALANCE:
+		auto_id = V4L2_CID_AUTO_WHITE_BALANCE;
+		break;
+	default:
+		return 0;
+	}
+
+	return auto_id;
+}
+
+static int arducam_init_controls(struct arducam *priv)
+{
+	struct arducam_ctrl_entry *entry;
+	struct v4l2_ctrl *ctrl;
+	int ret;
+	int index;
+	struct v4l2_ctrl_handler *ctrl_hdlr;
+	struct v4l2_fwnode_device_properties props;
+	u32 id, min, max, def, step;
+	struct i2c_client *client;
+	ctrl_hdlr = &priv->ctrl_handler;
+	client = priv->client;
+
+	ret = v4l2_ctrl_handler_init(ctrl_hdlr, priv->num_ctrl_descs);
+	if(ret)
+		return ret;
+
+	priv->ctrl_entries = devm_kcalloc(&client->dev, priv->num_ctrl_descs,
+				sizeof(*priv->ctrl_entries), GFP_KERNEL);
+	priv->snapshot.seq = devm_kcalloc(&client->dev,
+				ARDUCAM_SNAPSHOT_MODE_REGS + 2 * priv->num_ctrl_descs,
+				sizeof(*priv->snapshot.seq), GFP_KERNEL);
+	if (!priv->ctrl_entries || !priv->snapshot.seq) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	/* Serialize s_ctrl with the pad ops and the control queue worker */
+	ctrl_hdlr->lock = &priv->mutex;
+
+	for (index = 0; index < priv->num_ctrl_descs; index++) {
+		id = priv->ctrl_descs[index].id;
+		min = priv->ctrl_descs[index].min;
+		max = priv->ctrl_descs[index].max;
+		step = priv->ctrl_descs[index].step;
+		def = priv->ctrl_descs[index].def;
+
 		if (arducam_ctrl_get_name(id) != NULL) {
-			priv->ctrls[index] = v4l2_ctrl_new_arducam(ctrl_hdlr,
+			ctrl = v4l2_ctrl_new_arducam(ctrl_hdlr,
 						&arducam_ctrl_ops, id, min, max, step, def);
 			v4l2_dbg(1, debug, priv->client, "%s: new custom ctrl, ctrl: %p.\n",
-				__func__, priv->ctrls[index]);
+				__func__, ctrl);
 		} else {
 			v4l2_dbg(1, debug, priv->client, "%s: index = %x, id = %x, max = %x, min = %x\n",
 					__func__, index, id, max, min);
-			priv->ctrls[index] = v4l2_ctrl_new_std(ctrl_hdlr,
+			ctrl = v4l2_ctrl_new_std(ctrl_hdlr,
 						&arducam_ctrl_ops, id,
 						min, max, step, def);
 			v4l2_dbg(1, debug, priv->client, "%s: ctrl: %p\n",
-					__func__, priv->ctrls[index]);
+					__func__, ctrl);
 		}
+		if (!ctrl) {
+			/* Skip descriptors v4l2 rejects, but not running out of memory */
+			if (ctrl_hdlr->error == -ENOMEM)
+				break;
+			dev_warn(&client->dev, "skipping control 0x%x: %d\n",
+				 id, ctrl_hdlr->error);
+			ctrl_hdlr->error = 0;
+			continue;
+		}
+
+		entry = &priv->ctrl_entries[index];
+		entry->id = id;
+		entry->ctrl = ctrl;
+		entry->latency_class =
+			arducam_ctrl_desc_latency(&priv->ctrl_descs[index]);
+		hash_add(priv->ctrl_table, &entry->node, id);
 
 		switch(id) {
 		case V4L2_CID_HFLIP:
-			priv->hflip = priv->ctrls[index];
+			priv->hflip = ctrl;
 			if (priv->bayer_order_volatile)
 				priv->hflip->flags |= V4L2_CTRL_FLAG_MODIFY_LAYOUT;
 			break;
 
 		case V4L2_CID_VFLIP:
-			priv->vflip = priv->ctrls[index];
+			priv->vflip = ctrl;
 			if (priv->bayer_order_volatile)
 				priv->vflip->flags |= V4L2_CTRL_FLAG_MODIFY_LAYOUT;
 			break;
 
 		case V4L2_CID_HBLANK:
-			priv->ctrls[index]->flags |= V4L2_CTRL_FLAG_READ_ONLY;
+			ctrl->flags |= V4L2_CTRL_FLAG_READ_ONLY;
 			break;
 		}
+	}
 
-		index++;
+	for (index = 0; index < priv->num_ctrl_descs; index++) {
+		entry = &priv->ctrl_entries[index];
+		if (entry->ctrl)
+			entry->auto_ctrl = get_control(priv,
+					arducam_ctrl_auto_id(entry->id));
+	}
+
+	if (!get_control(priv, V4L2_CID_LINK_FREQ)) {
+		if (priv->num_link_freqs)
+			priv->link_freq = v4l2_ctrl_new_int_menu(ctrl_hdlr,
+						&arducam_ctrl_ops, V4L2_CID_LINK_FREQ,
+						priv->num_link_freqs - 1, 0,
+						priv->link_freqs);
+		else
+			priv->link_freq = v4l2_ctrl_new_int_menu(ctrl_hdlr,
+						&arducam_ctrl_ops, V4L2_CID_LINK_FREQ,
+						0, 0, &priv->link_freq_auto);
+		if (priv->link_freq)
+			priv->link_freq->flags |= V4L2_CTRL_FLAG_READ_ONLY;
+	}
+
+	v4l2_ctrl_new_custom(ctrl_hdlr, &arducam_sync_flush_ctrl, NULL);
+	if (priv->ctrl_hold) {
+		v4l2_ctrl_new_custom(ctrl_hdlr, &arducam_applied_frame_ctrl, NULL);
+		v4l2_ctrl_new_custom(ctrl_hdlr, &arducam_frame_count_ctrl, NULL);
+	}
+
+	if (ctrl_hdlr->error) {
+		ret = ctrl_hdlr->error;
+		dev_err(&client->dev, "%s control init failed (%d)\n",
+			__func__, ret);
+		goto err;
 	}
-	
-	arducam_write(client, CTRL_INDEX_REG, 0);
 
 	ret = v4l2_fwnode_device_parse(&client->dev, &props);
 	if (ret)
@@ -1508,11 +4072,413 @@ static int arducam_enum_controls(struct arducam *priv)
 	if (ret)
 		goto err;
 
+	/* Stream start batches one (CTRL_ID, CTRL_VALUE) pair per control */
+	list_for_each_entry(ctrl, &ctrl_hdlr->ctrls, node)
+		priv->max_ctrl_batch += 2;
+	priv->ctrl_batch = devm_kcalloc(&client->dev, priv->max_ctrl_batch,
+				sizeof(*priv->ctrl_batch), GFP_KERNEL);
+	if (!priv->ctrl_batch) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
 	priv->sd.ctrl_handler = ctrl_hdlr;
 	v4l2_ctrl_handler_setup(ctrl_hdlr);
+
+	/* The handler lock, arducam_update_link_freq() needs it held */
+	mutex_lock(&priv->mutex);
+	arducam_learn_mode(priv);
+	mutex_unlock(&priv->mutex);
+
 	return 0;
 err:
-	return -ENODEV;
+	v4l2_ctrl_handler_free(ctrl_hdlr);
+	return ret;
+}
+
+/* Serialize the enumerated descriptors, see the layout in arducam.h */
+static int arducam_desc_build(struct arducam *priv)
+{
+	struct device *dev = &priv->client->dev;
+	struct arducam_format *format;
+	struct arducam_ctrl_desc *ctrl;
+	size_t words = ARDUCAM_DESC_HDR_WORDS;
+	size_t pos;
+	__le32 *blob;
+	u32 sum = 0;
+	int i, j;
+
+	for (i = 0; i < priv->num_supported_formats; i++)
+		words += ARDUCAM_DESC_FORMAT_WORDS + ARDUCAM_DESC_RES_WORDS *
+			priv->supported_formats[i].num_resolution_set;
+	words += ARDUCAM_DESC_CTRL_WORDS * priv->num_ctrl_descs;
+
+	blob = devm_kcalloc(dev, words, sizeof(*blob), GFP_KERNEL);
+	if (!blob)
+		return -ENOMEM;
+
+	pos = ARDUCAM_DESC_HDR_WORDS;
+	for (i = 0; i < priv->num_supported_formats; i++) {
+		format = &priv->supported_formats[i];
+		blob[pos++] = cpu_to_le32(format->index);
+		blob[pos++] = cpu_to_le32(format->data_type);
+		blob[pos++] = cpu_to_le32(format->bayer_order);
+		blob[pos++] = cpu_to_le32(format->num_resolution_set);
+		for (j = 0; j < format->num_resolution_set; j++) {
+			blob[pos++] = cpu_to_le32(format->resolution_set[j].width);
+			blob[pos++] = cpu_to_le32(format->resolution_set[j].height);
+		}
+	}
+	for (i = 0; i < priv->num_ctrl_descs; i++) {
+		ctrl = &priv->ctrl_descs[i];
+		blob[pos++] = cpu_to_le32(ctrl->id);
+		blob[pos++] = cpu_to_le32(ctrl->min);
+		blob[pos++] = cpu_to_le32(ctrl->max);
+		blob[pos++] = cpu_to_le32(ctrl->step);
+		blob[pos++] = cpu_to_le32(ctrl->def);
+		blob[pos++] = cpu_to_le32(ctrl->latency);
+	}
+
+	for (pos = ARDUCAM_DESC_HDR_WORDS; pos < words; pos++)
+		sum += le32_to_cpu(blob[pos]);
+
+	blob[ARDUCAM_DESC_HDR_MAGIC] = cpu_to_le32(ARDUCAM_DESC_MAGIC);
+	blob[ARDUCAM_DESC_HDR_VERSION] = cpu_to_le32(ARDUCAM_DESC_VERSION);
+	blob[ARDUCAM_DESC_HDR_SENSOR_ID] = cpu_to_le32(priv->sensor_id);
+	blob[ARDUCAM_DESC_HDR_DEVICE_VERSION] =
+		cpu_to_le32(priv->firmware_version);
+	blob[ARDUCAM_DESC_HDR_FLAGS] = cpu_to_le32(priv->bayer_order_volatile ?
+		ARDUCAM_DESC_FLAG_BAYER_VOLATILE : 0);
+	blob[ARDUCAM_DESC_HDR_LANES] = cpu_to_le32(priv->lanes);
+	blob[ARDUCAM_DESC_HDR_NUM_FORMATS] =
+		cpu_to_le32(priv->num_supported_formats);
+	blob[ARDUCAM_DESC_HDR_NUM_CTRLS] = cpu_to_le32(priv->num_ctrl_descs);
+	blob[ARDUCAM_DESC_HDR_CHECKSUM] = cpu_to_le32(sum);
+
+	priv->desc_blob = blob;
+	priv->desc_words = words;
+
+	return 0;
+}
+
+/*
+ * Rebuild formats and control descriptors from a blob. The blob must
+ * belong to the bridge that is actually present (same sensor id and
+ * firmware version) and pass the size and checksum checks.
+ */
+static int arducam_desc_parse(struct arducam *priv, const __le32 *blob,
+							size_t words)
+{
+	struct device *dev = &priv->client->dev;
+	struct arducam_format *formats;
+	struct arducam_ctrl_desc *ctrls;
+	u32 num_formats, num_ctrls, num_res, sum = 0;
+	size_t pos, ctrl_words;
+	int i, j;
+
+	if (words < ARDUCAM_DESC_HDR_WORDS ||
+	    le32_to_cpu(blob[ARDUCAM_DESC_HDR_MAGIC]) != ARDUCAM_DESC_MAGIC)
+		return -EINVAL;
+
+	switch (le32_to_cpu(blob[ARDUCAM_DESC_HDR_VERSION])) {
+	case ARDUCAM_DESC_VERSION:
+		ctrl_words = ARDUCAM_DESC_CTRL_WORDS;
+		break;
+	case ARDUCAM_DESC_VERSION_V1:
+		ctrl_words = ARDUCAM_DESC_CTRL_WORDS_V1;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (le32_to_cpu(blob[ARDUCAM_DESC_HDR_SENSOR_ID]) != priv->sensor_id ||
+	    le32_to_cpu(blob[ARDUCAM_DESC_HDR_DEVICE_VERSION]) !=
+			priv->firmware_version)
+		return -ENOENT;
+
+	for (pos = ARDUCAM_DESC_HDR_WORDS; pos < words; pos++)
+		sum += le32_to_cpu(blob[pos]);
+	if (sum != le32_to_cpu(blob[ARDUCAM_DESC_HDR_CHECKSUM]))
+		return -EBADMSG;
+
+	num_formats = le32_to_cpu(blob[ARDUCAM_DESC_HDR_NUM_FORMATS]);
+	num_ctrls = le32_to_cpu(blob[ARDUCAM_DESC_HDR_NUM_CTRLS]);
+	if (!num_formats || num_formats > ARDUCAM_DESC_MAX_FORMATS ||
+	    num_ctrls > ARDUCAM_DESC_MAX_CTRLS)
+		return -EINVAL;
+
+	/* One spare entry, as arducam_enum_pixformat() allocates */
+	formats = devm_kcalloc(dev, num_formats + 1, sizeof(*formats),
+			       GFP_KERNEL);
+	ctrls = devm_kcalloc(dev, num_ctrls ? num_ctrls : 1, sizeof(*ctrls),
+			     GFP_KERNEL);
+	if (!formats || !ctrls)
+		return -ENOMEM;
+
+	pos = ARDUCAM_DESC_HDR_WORDS;
+	for (i = 0; i < num_formats; i++) {
+		if (pos + ARDUCAM_DESC_FORMAT_WORDS > words)
+			return -EINVAL;
+
+		formats[i].index = le32_to_cpu(blob[pos++]);
+		formats[i].data_type = le32_to_cpu(blob[pos++]);
+		formats[i].bayer_order = le32_to_cpu(blob[pos++]);
+		num_res = le32_to_cpu(blob[pos++]);
+		if (!num_res || num_res > ARDUCAM_DESC_MAX_RESOLUTIONS ||
+		    pos + ARDUCAM_DESC_RES_WORDS * num_res > words)
+			return -EINVAL;
+
+		formats[i].mbus_code = data_type_to_mbus_code(
+			formats[i].data_type, formats[i].bayer_order);
+		formats[i].num_resolution_set = num_res;
+		formats[i].resolution_set = devm_kcalloc(dev, num_res,
+			sizeof(*formats[i].resolution_set), GFP_KERNEL);
+		if (!formats[i].resolution_set)
+			return -ENOMEM;
+
+		for (j = 0; j < num_res; j++) {
+			formats[i].resolution_set[j].width = le32_to_cpu(blob[pos++]);
+			formats[i].resolution_set[j].height = le32_to_cpu(blob[pos++]);
+		}
+	}
+
+	if (pos + ctrl_words * num_ctrls != words)
+		return -EINVAL;
+
+	for (i = 0; i < num_ctrls; i++) {
+		ctrls[i].id = le32_to_cpu(blob[pos++]);
+		ctrls[i].min = le32_to_cpu(blob[pos++]);
+		ctrls[i].max = le32_to_cpu(blob[pos++]);
+		ctrls[i].step = le32_to_cpu(blob[pos++]);
+		ctrls[i].def = le32_to_cpu(blob[pos++]);
+		ctrls[i].latency = ctrl_words > ARDUCAM_DESC_CTRL_WORDS_V1 ?
+			le32_to_cpu(blob[pos++]) : NO_DATA_AVAILABLE;
+	}
+
+	priv->supported_formats = formats;
+	priv->num_supported_formats = num_formats;
+	priv->current_format_idx = 0;
+	priv->current_resolution_idx = 0;
+	priv->ctrl_descs = ctrls;
+	priv->num_ctrl_descs = num_ctrls;
+	priv->lanes = le32_to_cpu(blob[ARDUCAM_DESC_HDR_LANES]);
+	priv->bayer_order_volatile = !!(le32_to_cpu(blob[ARDUCAM_DESC_HDR_FLAGS]) &
+		ARDUCAM_DESC_FLAG_BAYER_VOLATILE);
+
+	return 0;
+}
+
+/* Try to skip the bridge walk with a descriptor blob saved earlier */
+static int arducam_desc_load_cache(struct arducam *priv)
+{
+	struct device *dev = &priv->client->dev;
+	const struct firmware *fw;
+	char name[64];
+	int ret;
+
+	if (!desc_cache)
+		return -ENOENT;
+
+	snprintf(name, sizeof(name), ARDUCAM_DESC_FW_NAME,
+		 priv->sensor_id, priv->firmware_version);
+	ret = request_firmware_direct(&fw, name, dev);
+	if (ret)
+		return ret;
+
+	if (fw->size % sizeof(__le32))
+		ret = -EINVAL;
+	else
+		ret = arducam_desc_parse(priv, (const __le32 *)fw->data,
+					 fw->size / sizeof(__le32));
+	release_firmware(fw);
+
+	if (ret)
+		dev_warn(dev, "ignoring descriptor cache %s: %d\n", name, ret);
+	else
+		dev_info(dev, "descriptors loaded from %s\n", name);
+
+	return ret;
+}
+
+/*
+ * Fetch the descriptor blob from the bridge descriptor window, if the
+ * firmware has one. Costs a handful of transfers instead of the index walk.
+ */
+static int arducam_desc_read_window(struct arducam *priv)
+{
+	struct i2c_client *client = priv->client;
+	u32 layout, length, page, chunk;
+	__le32 *blob;
+	size_t pos;
+	int ret;
+
+	if (priv->firmware_version == NO_DATA_AVAILABLE ||
+	    priv->firmware_version < DESC_WINDOW_MIN_VERSION)
+		return -ENOENT;
+
+	ret = arducam_read(client, DESC_LAYOUT_REG, &layout);
+	if (ret || (layout != ARDUCAM_DESC_VERSION &&
+		    layout != ARDUCAM_DESC_VERSION_V1))
+		return -ENOENT;
+
+	ret = arducam_read(client, DESC_LENGTH_REG, &length);
+	if (ret || length < ARDUCAM_DESC_HDR_WORDS ||
+	    length > ARDUCAM_DESC_MAX_WORDS)
+		return -EINVAL;
+
+	blob = kcalloc(length, sizeof(*blob), GFP_KERNEL);
+	if (!blob)
+		return -ENOMEM;
+
+	for (pos = 0, page = 0; pos < length; page++) {
+		chunk = min_t(u32, length - pos, DESC_WINDOW_WORDS);
+		ret = arducam_write(client, DESC_PAGE_REG, page);
+		if (!ret)
+			ret = arducam_read_window(client, DESC_WINDOW_BASE,
+						  blob + pos, chunk);
+		if (ret)
+			goto out;
+		pos += chunk;
+	}
+
+	ret = arducam_desc_parse(priv, blob, length);
+	if (ret)
+		dev_warn(&client->dev, "bad descriptor window: %d\n", ret);
+	else
+		dev_info(&client->dev, "descriptors read from bridge window\n");
+
+out:
+	kfree(blob);
+	return ret;
+}
+
+static ssize_t descriptors_read(struct file *file, struct kobject *kobj,
+				struct bin_attribute *attr, char *buf,
+				loff_t off, size_t count)
+{
+	struct i2c_client *client = to_i2c_client(kobj_to_dev(kobj));
+	struct arducam *priv = client_to_arducam(client);
+
+	return memory_read_from_buffer(buf, count, &off, priv->desc_blob,
+				       priv->desc_words * sizeof(__le32));
+}
+static BIN_ATTR_RO(descriptors, 0);
+
+static ssize_t sync_group_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct arducam *priv = client_to_arducam(to_i2c_client(dev));
+	ssize_t len;
+
+	mutex_lock(&arducam_sync_lock);
+	if (priv->sync_group)
+		len = sysfs_emit(buf, "%u %s\n", priv->sync_group->id,
+				 arducam_sync_role_names[priv->sync_role]);
+	else
+		len = sysfs_emit(buf, "none\n");
+	mutex_unlock(&arducam_sync_lock);
+
+	return len;
+}
+
+/* "<group> master", "<group> slave" or "none" */
+static ssize_t sync_group_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct arducam *priv = client_to_arducam(to_i2c_client(dev));
+	enum arducam_sync_role role;
+	char name[8];
+	u32 id = 0;
+	int ret;
+
+	if (sysfs_streq(buf, "none"))
+		role = ARDUCAM_SYNC_NONE;
+	else if (sscanf(buf, "%u %7s", &id, name) == 2 &&
+		 !strcmp(name, "master"))
+		role = ARDUCAM_SYNC_MASTER;
+	else if (sscanf(buf, "%u %7s", &id, name) == 2 &&
+		 !strcmp(name, "slave"))
+		role = ARDUCAM_SYNC_SLAVE;
+	else
+		return -EINVAL;
+
+	mutex_lock(&arducam_sync_lock);
+	mutex_lock(&priv->mutex);
+	if (priv->streaming)
+		ret = -EBUSY;
+	else
+		ret = __arducam_sync_join(priv, id, role);
+	mutex_unlock(&priv->mutex);
+	mutex_unlock(&arducam_sync_lock);
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(sync_group);
+
+static void arducam_probe_phase_done(struct arducam *arducam,
+				     enum arducam_probe_phase phase,
+				     ktime_t *start)
+{
+	ktime_t now = ktime_get();
+
+	arducam->probe_us[phase] = ktime_us_delta(now, *start);
+	*start = now;
+}
+
+/*
+ * The bridge reports the lanes it drives by default, DT the lanes that are
+ * wired. Ask the bridge for the DT count when they differ; use whatever
+ * it accepts, and fail the probe if it keeps driving more lanes than the
+ * receiver has.
+ */
+static int arducam_setup_lanes(struct arducam *priv)
+{
+	struct i2c_client *client = priv->client;
+	int dt_lanes = priv->ep.bus.mipi_csi2.num_data_lanes;
+	u32 lanes;
+
+	if (!dt_lanes || dt_lanes == priv->lanes)
+		return 0;
+
+	if (!arducam_write(client, MIPI_LANES_REG, dt_lanes) &&
+	    !arducam_read(client, MIPI_LANES_REG, &lanes) &&
+	    lanes == dt_lanes) {
+		priv->lanes_override = true;
+		priv->lanes = dt_lanes;
+	} else if (priv->lanes > dt_lanes) {
+		/* The receiver would never see the extra lanes */
+		dev_err(&client->dev,
+			"bridge drives %d lanes, only %d wired\n",
+			priv->lanes, dt_lanes);
+		return -EINVAL;
+	}
+
+	dev_info(&client->dev, "using %d lanes, %d wired\n",
+		 priv->lanes, dt_lanes);
+
+	return 0;
+}
+
+/*
+ * Optional DT membership:
+ *   arducam,sync-group = <id>;	group shared by all cameras of a rig
+ *   arducam,sync-master;		this camera drives the trigger
+ */
+static void arducam_sync_init(struct arducam *priv)
+{
+	struct device *dev = &priv->client->dev;
+	u32 id;
+	int ret;
+
+	if (device_property_read_u32(dev, "arducam,sync-group", &id))
+		return;
+
+	ret = arducam_sync_join(priv, id,
+			device_property_read_bool(dev, "arducam,sync-master") ?
+			ARDUCAM_SYNC_MASTER : ARDUCAM_SYNC_SLAVE);
+	if (ret)
+		dev_warn(dev, "failed to join sync group %u: %d\n", id, ret);
 }
 
 static int arducam_probe(struct i2c_client *client,
@@ -1523,6 +4489,9 @@ static int arducam_probe(struct i2c_client *client,
 	struct arducam *arducam;
     u32 device_id;
 	u32 firmware_version;
+	u32 hold;
+	const char *source;
+	ktime_t start;
 	int ret;
 	arducam = devm_kzalloc(&client->dev, sizeof(*arducam), GFP_KERNEL);
 	if (!arducam)
@@ -1530,6 +4499,19 @@ static int arducam_probe(struct i2c_client *client,
 	/* Initialize subdev */
 	v4l2_i2c_subdev_init(&arducam->sd, client, &arducam_subdev_ops);
 	arducam->client = client;
+	mutex_init(&arducam->mutex);
+	mutex_init(&arducam->reg_lock);
+	INIT_WORK(&arducam->ctrl_work, arducam_ctrl_work);
+	INIT_LIST_HEAD(&arducam->ctrl_queue);
+	spin_lock_init(&arducam->stats_lock);
+
+	arducam->regmap = devm_regmap_init(dev, &arducam_regmap_bus, client,
+					   &arducam_regmap_config);
+	if (IS_ERR(arducam->regmap)) {
+		dev_err(dev, "failed to initialize regmap\n");
+		return PTR_ERR(arducam->regmap);
+	}
+	arducam->sel_target = U32_MAX;
 
 	/* Get CSI2 bus config */
 	endpoint = fwnode_graph_get_next_endpoint(dev_fwnode(&client->dev),
@@ -1539,13 +4521,27 @@ static int arducam_probe(struct i2c_client *client,
 		return -EINVAL;
 	}
 
-	ret = v4l2_fwnode_endpoint_parse(endpoint, &arducam->ep);
+	arducam->ep.bus_type = V4L2_MBUS_CSI2_DPHY;
+	ret = v4l2_fwnode_endpoint_alloc_parse(endpoint, &arducam->ep);
 	fwnode_handle_put(endpoint);
 	if (ret) {
 		dev_err(dev, "Could not parse endpoint\n");
 		return ret;
 	}
 
+	/* Keep link-frequencies for the LINK_FREQ menu, lowest first */
+	arducam->num_link_freqs = arducam->ep.nr_of_link_frequencies;
+	if (arducam->num_link_freqs)
+		arducam->link_freqs = devm_kmemdup(dev,
+				arducam->ep.link_frequencies,
+				arducam->num_link_freqs * sizeof(u64),
+				GFP_KERNEL);
+	v4l2_fwnode_endpoint_free(&arducam->ep);
+	if (arducam->num_link_freqs && !arducam->link_freqs)
+		return -ENOMEM;
+	sort(arducam->link_freqs, arducam->num_link_freqs, sizeof(u64),
+	     arducam_link_freq_cmp, NULL);
+
 	/* Get system clock (xclk) */
 	arducam->xclk = devm_clk_get(dev, "xclk");
 	if (IS_ERR(arducam->xclk)) {
@@ -1566,14 +4562,40 @@ static int arducam_probe(struct i2c_client *client,
 	arducam->reset_gpio = devm_gpiod_get_optional(dev, "reset",
 						     GPIOD_OUT_HIGH);
 
+	/*
+	 * Optional bridge ready notification, either as an interrupt on the
+	 * client node or as a "ready" GPIO. Fall back to polling without it.
+	 */
+	init_completion(&arducam->idle_done);
+	arducam->ready_gpio = devm_gpiod_get_optional(dev, "ready", GPIOD_IN);
+	if (IS_ERR(arducam->ready_gpio)) {
+		dev_err(dev, "failed to get ready gpio\n");
+		return PTR_ERR(arducam->ready_gpio);
+	}
+	if (client->irq > 0)
+		arducam->ready_irq = client->irq;
+	else if (arducam->ready_gpio)
+		arducam->ready_irq = gpiod_to_irq(arducam->ready_gpio);
+
+	if (arducam->ready_irq > 0) {
+		ret = devm_request_irq(dev, arducam->ready_irq, arducam_ready_irq,
+				       IRQF_TRIGGER_RISING, dev_name(dev), arducam);
+		if (ret) {
+			dev_warn(dev, "failed to request ready irq, polling\n");
+			arducam->ready_irq = 0;
+		}
+	}
 
-		/*
+	/*
 	 * The sensor must be powered for imx219_identify_module()
 	 * to be able to read the CHIP_ID register
 	 */
+	start = ktime_get();
 	ret = arducam_power_on(dev);
 	if (ret)
 		return ret;
+	arducam_probe_phase_done(arducam, PROBE_PHASE_POWER, &start);
+
 	ret = arducam_read(client, DEVICE_ID_REG, &device_id);
 	if (ret || device_id != DEVICE_ID) {
 		dev_err(&client->dev, "probe failed\n");
@@ -1586,26 +4608,59 @@ static int arducam_probe(struct i2c_client *client,
 		dev_err(&client->dev, "read firmware version failed\n");
 	}
 	dev_info(&client->dev, "firmware version: 0x%04X\n", firmware_version);
+	arducam->firmware_version = firmware_version;
 
-	if (arducam_enum_pixformat(arducam)) {
-		dev_err(&client->dev, "enum pixformat failed.\n");
-		ret = -ENODEV;
-		goto error_power_off;
+	ret = arducam_read(client, SENSOR_ID_REG, &arducam->sensor_id);
+	if (ret)
+		dev_err(&client->dev, "read sensor id failed\n");
+
+	ret = arducam_read(client, CTRL_HOLD_REG, &hold);
+	arducam->ctrl_hold = !ret && hold != NO_DATA_AVAILABLE;
+
+	arducam_probe_phase_done(arducam, PROBE_PHASE_IDENTIFY, &start);
+
+	if (!arducam_desc_load_cache(arducam)) {
+		source = "cache";
+	} else if (!arducam_desc_read_window(arducam)) {
+		source = "window";
+	} else {
+		source = "walk";
+		if (arducam_enum_pixformat(arducam)) {
+			dev_err(&client->dev, "enum pixformat failed.\n");
+			ret = -ENODEV;
+			goto error_power_off;
+		}
+
+		arducam_write_reg(arducam, arducam_REG_MODE_SELECT,
+					arducam_REG_VALUE_32BIT, arducam_MODE_STREAMING);
+
+		wait_for_free(arducam->client, 5);
+
+		if (arducam_enum_controls(arducam)) {
+			dev_err(dev, "enum controls failed.\n");
+			ret = -ENODEV;
+			goto error_power_off;
+		}
+
+		arducam_write_reg(arducam, arducam_REG_MODE_SELECT,
+					arducam_REG_VALUE_32BIT, arducam_MODE_STANDBY);
 	}
-	
-	arducam_write_reg(arducam, arducam_REG_MODE_SELECT,
-				arducam_REG_VALUE_32BIT, arducam_MODE_STREAMING);
-	
-	wait_for_free(arducam->client, 5);
 
-	if (arducam_enum_controls(arducam)) {
-		dev_err(dev, "enum controls failed.\n");
-		ret = -ENODEV;
+	ret = arducam_desc_build(arducam);
+	if (!ret)
+		ret = arducam_build_lookup(arducam);
+	if (!ret)
+		ret = arducam_setup_lanes(arducam);
+	if (ret)
 		goto error_power_off;
-	}
+	arducam_probe_phase_done(arducam, PROBE_PHASE_DESCRIPTORS, &start);
 
-	arducam_write_reg(arducam, arducam_REG_MODE_SELECT,
-				arducam_REG_VALUE_32BIT, arducam_MODE_STANDBY);
+	ret = arducam_init_controls(arducam);
+	if (ret) {
+		dev_err(dev, "init controls failed.\n");
+		goto error_power_off;
+	}
+	arducam_probe_phase_done(arducam, PROBE_PHASE_CONTROLS, &start);
 
 	/* Initialize subdev */
 	arducam->sd.internal_ops = &arducam_internal_ops;
@@ -1619,17 +4674,49 @@ static int arducam_probe(struct i2c_client *client,
 	if (ret)
 		goto error_handler_free;
 
-	ret = v4l2_async_register_subdev_sensor_common(&arducam->sd);
-	if (ret < 0)
-		goto error_media_entity;
+	ret = device_create_bin_file(dev, &bin_attr_descriptors);
+	if (ret)
+		dev_warn(dev, "failed to create descriptors attribute\n");
+
+	arducam_sync_init(arducam);
+	ret = device_create_file(dev, &dev_attr_sync_group);
+	if (ret)
+		dev_warn(dev, "failed to create sync_group attribute\n");
+
+	arducam_debugfs_init(arducam);
 
 	pm_runtime_set_active(dev);
+	pm_runtime_set_autosuspend_delay(dev, autosuspend_delay_ms);
+	pm_runtime_use_autosuspend(dev);
 	pm_runtime_enable(dev);
+
+	/* Last: the receiver may start streaming as soon as it binds */
+	ret = v4l2_async_register_subdev_sensor_common(&arducam->sd);
+	if (ret < 0)
+		goto error_pm_disable;
+
+	pm_runtime_mark_last_busy(dev);
 	pm_runtime_idle(dev);
 
+	arducam_probe_phase_done(arducam, PROBE_PHASE_REGISTER, &start);
+
+	dev_info(dev, "probe: power %u us, identify %u us, descriptors %u us (%s), controls %u us, register %u us\n",
+		 arducam->probe_us[PROBE_PHASE_POWER],
+		 arducam->probe_us[PROBE_PHASE_IDENTIFY],
+		 arducam->probe_us[PROBE_PHASE_DESCRIPTORS], source,
+		 arducam->probe_us[PROBE_PHASE_CONTROLS],
+		 arducam->probe_us[PROBE_PHASE_REGISTER]);
+
 	return 0;
 
-error_media_entity:
+error_pm_disable:
+	pm_runtime_disable(dev);
+	pm_runtime_dont_use_autosuspend(dev);
+	pm_runtime_set_suspended(dev);
+	debugfs_remove_recursive(arducam->debugfs);
+	device_remove_file(dev, &dev_attr_sync_group);
+	arducam_sync_join(arducam, 0, ARDUCAM_SYNC_NONE);
+	device_remove_bin_file(dev, &bin_attr_descriptors);
 	media_entity_cleanup(&arducam->sd.entity);
 
 error_handler_free:
@@ -1646,11 +4733,18 @@ static int arducam_remove(struct i2c_client *client)
 	struct v4l2_subdev *sd = i2c_get_clientdata(client);
 	struct arducam *arducam = to_arducam(sd);
 
+	debugfs_remove_recursive(arducam->debugfs);
+	device_remove_bin_file(&client->dev, &bin_attr_descriptors);
+	device_remove_file(&client->dev, &dev_attr_sync_group);
+	arducam_sync_join(arducam, 0, ARDUCAM_SYNC_NONE);
 	v4l2_async_unregister_subdev(sd);
 	media_entity_cleanup(&sd->entity);
 	arducam_free_controls(arducam);
 
 	pm_runtime_disable(&client->dev);
+	pm_runtime_dont_use_autosuspend(&client->dev);
+	if (!pm_runtime_status_suspended(&client->dev))
+		arducam_power_off(&client->dev);
 	pm_runtime_set_suspended(&client->dev);
 
 	return 0;
@@ -1658,7 +4752,7 @@ static int arducam_remove(struct i2c_client *client)
 
 static const struct dev_pm_ops arducam_pm_ops = {
 	SET_SYSTEM_SLEEP_PM_OPS(arducam_suspend, arducam_resume)
-	SET_RUNTIME_PM_OPS(arducam_power_off, arducam_power_on, NULL)
+	SET_RUNTIME_PM_OPS(arducam_power_off, arducam_runtime_resume, NULL)
 };
 
 static const struct of_device_id arducam_dt_ids[] = {
@@ -1667,14 +4761,24 @@ static const struct of_device_id arducam_dt_ids[] = {
 };
 MODULE_DEVICE_TABLE(of, arducam_dt_ids);
 
+/* For boards without DT, and the bridge simulator */
+static const struct i2c_device_id arducam_id[] = {
+	{ "arducam-pivariety", 0 },
+	{ }
+};
+MODULE_DEVICE_TABLE(i2c, arducam_id);
+
 static struct i2c_driver arducam_i2c_driver = {
 	.driver = {
 		.name = "arducam-pivariety",
 		.of_match_table	= arducam_dt_ids,
 		.pm = &arducam_pm_ops,
+		/* Boot and other cameras do not wait on bridge enumeration */
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	},
 	.probe = arducam_probe,
 	.remove = arducam_remove,
+	.id_table = arducam_id,
 };
 
 module_i2c_driver(arducam_i2c_driver);
@@ -2,17 +2,24 @@
 #define _ARDUCAM_CSI_2_H_
 //typedef unsigned long u32;
 #include <asm-generic/int-ll64.h>
+#include <linux/types.h>
 #define DEVICE_REG_BASE 0x0100
 #define PIXFORMAT_REG_BASE 0x0200
 #define FORMAT_REG_BASE 0x0300
 #define CTRL_REG_BASE 0x0400
 #define IPC_REG_BASE 0x0600
+#define DESC_REG_BASE 0x0700
+#define DESC_WINDOW_BASE 0x0800
 
 #define STREAM_ON           (DEVICE_REG_BASE | 0x0000)
 #define DEVICE_VERSION_REG  (DEVICE_REG_BASE | 0x0001)
 #define SENSOR_ID_REG       (DEVICE_REG_BASE | 0x0002)
 #define DEVICE_ID_REG       (DEVICE_REG_BASE | 0x0003)
 #define SYSTEM_IDLE_REG		(DEVICE_REG_BASE | 0x0007)
+#define FRAME_COUNT_REG		(DEVICE_REG_BASE | 0x0008)
+/* Embedded data the current mode is sent with, see struct arducam_frame_meta */
+#define METADATA_WIDTH_REG	(DEVICE_REG_BASE | 0x0009)
+#define METADATA_LINES_REG	(DEVICE_REG_BASE | 0x000A)
 
 #define PIXFORMAT_INDEX_REG			(PIXFORMAT_REG_BASE | 0x0000)
 #define PIXFORMAT_TYPE_REG			(PIXFORMAT_REG_BASE | 0x0001)
@@ -31,6 +38,19 @@
 #define CTRL_STEP_REG   (CTRL_REG_BASE | 0x0004)
 #define CTRL_DEF_REG    (CTRL_REG_BASE | 0x0005)
 #define CTRL_VALUE_REG  (CTRL_REG_BASE | 0x0006)
+/*
+ * Grouped hold: while CTRL_HOLD_REG is 1 the bridge stages CTRL_VALUE
+ * writes, clearing it commits them together at the next frame start.
+ * CTRL_APPLY_FRAME_REG then reports the FRAME_COUNT_REG value of that frame.
+ * Older firmware reads NO_DATA_AVAILABLE here.
+ */
+#define CTRL_HOLD_REG			(CTRL_REG_BASE | 0x0007)
+#define CTRL_APPLY_FRAME_REG	(CTRL_REG_BASE | 0x0008)
+/*
+ * How long the bridge needs after a write to the control at CTRL_INDEX_REG,
+ * as an enum arducam_ctrl_latency. Older firmware reads NO_DATA_AVAILABLE.
+ */
+#define CTRL_LATENCY_REG		(CTRL_REG_BASE | 0x0009)
 
 #define IPC_SEL_TARGET_REG	(IPC_REG_BASE | 0x0000)
 #define IPC_SEL_TOP_REG		(IPC_REG_BASE | 0x0001)
@@ -38,6 +58,23 @@
 #define IPC_SEL_WIDTH_REG	(IPC_REG_BASE | 0x0003)
 #define IPC_SEL_HEIGHT_REG	(IPC_REG_BASE | 0x0004)
 #define IPC_DELAY_REG		(IPC_REG_BASE | 0x0005)
+/*
+ * Crop granularity: horizontal step in the low 16 bits, vertical step in
+ * the high 16 bits. Writing IPC_SEL_TOP_REG .. IPC_SEL_HEIGHT_REG with
+ * IPC_SEL_TARGET_REG set to V4L2_SEL_TGT_CROP moves the readout window.
+ */
+#define IPC_SEL_ALIGN_REG	(IPC_REG_BASE | 0x0006)
+
+/*
+ * Descriptor window: newer firmware serves the whole descriptor blob
+ * (layout below) through a paged window of DESC_WINDOW_WORDS registers,
+ * so it can be fetched with a few block reads instead of the index walk.
+ */
+#define DESC_LAYOUT_REG		(DESC_REG_BASE | 0x0000)
+#define DESC_LENGTH_REG		(DESC_REG_BASE | 0x0001)
+#define DESC_PAGE_REG		(DESC_REG_BASE | 0x0002)
+#define DESC_WINDOW_WORDS	0x0100
+#define DESC_WINDOW_MIN_VERSION	0x0100
 
 #define NO_DATA_AVAILABLE   0xFFFFFFFE
 
@@ -45,6 +82,8 @@
 
 #define I2C_READ_RETRY_COUNT 3
 #define I2C_WRITE_RETRY_COUNT 2
+/* Max consecutive 32-bit registers moved by one block transfer */
+#define I2C_BLOCK_MAX_REGS 8
 
 /* opencv does not support Y10 or Y12, but supports Y16 */
 /* so pretend we are Y16 */
@@ -66,6 +105,10 @@
 #define V4L2_CID_ARDUCAM_PAN_Y_ABSOLUTE			(V4L2_CID_ARDUCAM_BASE + 11)
 #define V4L2_CID_ARDUCAM_ZOOM_PAN_SPEED			(V4L2_CID_ARDUCAM_BASE + 12)
 #define V4L2_CID_ARDUCAM_DENOISE				(V4L2_CID_ARDUCAM_BASE + 13)
+/* Driver-side controls, never sent to the bridge */
+#define V4L2_CID_ARDUCAM_SYNC_FLUSH				(V4L2_CID_ARDUCAM_BASE + 0x100)
+#define V4L2_CID_ARDUCAM_APPLIED_FRAME			(V4L2_CID_ARDUCAM_BASE + 0x101)
+#define V4L2_CID_ARDUCAM_FRAME_COUNT			(V4L2_CID_ARDUCAM_BASE + 0x102)
 
 
 enum image_dt {
@@ -116,8 +159,101 @@ struct arducam_resolution {
 	u32 height;
 	const struct reg_8 *regs;
 	int num_regs;
+	/* Learned from the bridge once the mode has been selected, 0 until then */
+	u32 min_fps;
+	u32 max_fps;
+	u32 fps_step;
+	u64 pixel_rate;
+};
+
+/*
+ * Per-frame embedded metadata. When METADATA_WIDTH_REG reports a line
+ * length the bridge sends METADATA_LINES_REG lines of that many bytes as
+ * CSI-2 embedded data with every frame, starting with this record. All
+ * fields are little-endian; the rest of the lines is zero.
+ */
+#define ARDUCAM_META_MAGIC		0x4154454d	/* "META" */
+#define ARDUCAM_META_VERSION	1
+#define ARDUCAM_META_MAX_FACES	8
+
+struct arducam_meta_face {
+	__le16 left;
+	__le16 top;
+	__le16 width;
+	__le16 height;
+} __attribute__((packed));
+
+struct arducam_frame_meta {
+	__le32 magic;
+	__le16 version;
+	__le16 size;			/* bytes, including faces[] */
+	__le32 frame_count;		/* FRAME_COUNT_REG of this frame */
+	__le32 exposure;		/* V4L2_CID_EXPOSURE units */
+	__le32 analogue_gain;	/* V4L2_CID_ANALOGUE_GAIN units */
+	__le32 digital_gain;	/* V4L2_CID_DIGITAL_GAIN units */
+	__le32 vblank;			/* lines */
+	__le32 temperature;		/* sensor, signed millidegrees Celsius */
+	__le32 num_faces;		/* valid entries in faces[] */
+	struct arducam_meta_face faces[ARDUCAM_META_MAX_FACES];
+} __attribute__((packed));
+
+enum arducam_ctrl_latency {
+	/* Latched by the bridge, the next write can follow immediately */
+	ARDUCAM_LATENCY_FAST,
+	/* Needs a short settle before the bridge takes the next write */
+	ARDUCAM_LATENCY_SETTLE,
+	/* Reconfigures the sensor mode or ISP, wait until the bridge is idle */
+	ARDUCAM_LATENCY_RECONFIG,
+	NUM_ARDUCAM_LATENCIES,
 };
 
+struct arducam_ctrl_desc {
+	u32 id;
+	u32 min;
+	u32 max;
+	u32 step;
+	u32 def;
+	/* enum arducam_ctrl_latency, NO_DATA_AVAILABLE if not reported */
+	u32 latency;
+};
+
+/*
+ * Descriptor blob: everything enumerated from the bridge at probe, as a
+ * sequence of 32-bit words. It is stored little-endian in the cache file
+ * and big-endian, like every register, in the bridge descriptor window.
+ *
+ *   header   ARDUCAM_DESC_HDR_WORDS words, see enum arducam_desc_hdr
+ *   formats  num_formats x
+ *              { index, data_type, bayer_order, num_resolutions,
+ *                num_resolutions x { width, height } }
+ *   controls num_ctrls x { id, min, max, step, def, latency }
+ *
+ * Version 1 blobs lack the latency word.
+ * The checksum is the 32-bit sum of all words following the header.
+ */
+#define ARDUCAM_DESC_MAGIC			0x41444353	/* "ADCS" */
+#define ARDUCAM_DESC_VERSION		2
+#define ARDUCAM_DESC_VERSION_V1		1
+#define ARDUCAM_DESC_FLAG_BAYER_VOLATILE	(1 << 0)
+
+enum arducam_desc_hdr {
+	ARDUCAM_DESC_HDR_MAGIC,
+	ARDUCAM_DESC_HDR_VERSION,
+	ARDUCAM_DESC_HDR_SENSOR_ID,
+	ARDUCAM_DESC_HDR_DEVICE_VERSION,
+	ARDUCAM_DESC_HDR_FLAGS,
+	ARDUCAM_DESC_HDR_LANES,
+	ARDUCAM_DESC_HDR_NUM_FORMATS,
+	ARDUCAM_DESC_HDR_NUM_CTRLS,
+	ARDUCAM_DESC_HDR_CHECKSUM,
+	ARDUCAM_DESC_HDR_WORDS,
+};
+
+#define ARDUCAM_DESC_FORMAT_WORDS	4
+#define ARDUCAM_DESC_RES_WORDS		2
+#define ARDUCAM_DESC_CTRL_WORDS		6
+#define ARDUCAM_DESC_CTRL_WORDS_V1	5
+
 struct arducam_format {
 	u32 index;
 	u32 mbus_code;
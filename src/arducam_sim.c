@@ -0,0 +1,476 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Software model of the Arducam Pivariety bridge
+ * Copyright (C) 2021, Arducam
+ *
+ * Registers a virtual I2C adapter with a Pivariety bridge behind it and
+ * instantiates the arducam-pivariety driver on it, so that probe, S_FMT,
+ * controls and streaming can be exercised and timed without hardware:
+ *
+ *   make ARDUCAM_SIM=y
+ *   insmod arducam.ko && insmod arducam_sim.ko resolutions=1920,1080
+ *
+ * The bridge speaks the register protocol from arducam.h: 16-bit register
+ * addresses, 32-bit big-endian values, auto-incrementing over consecutive
+ * registers. Index windows read NO_DATA_AVAILABLE past their last entry,
+ * as do registers the model does not know about. SYSTEM_IDLE_REG reports
+ * busy for idle_us after every write that reconfigures the sensor, and
+ * every nak_every-th transfer fails as if the bridge had not acknowledged.
+ *
+ * There is no CSI-2 receiver to register the sensor's subdev node, so the
+ * model registers it itself; arducam.ko must be loaded first.
+ *
+ * The driver's debugfs files measure the bridge traffic of each path:
+ * write to arducam-<device>/reset, run the path, e.g. a v4l2-ctl
+ * --set-subdev-fmt on the subdev node, then read arducam-<device>/ops for
+ * the I2C transfers and registers per call, or stats for the totals per
+ * register block. The model keeps its own count in the xfers and regs
+ * parameters, which also works for driver builds without these files.
+ * tools/arducam_sim_bench.py does this for every path and compares the
+ * counts with a recorded baseline.
+ *
+ * The endpoint is described with a software node graph, which needs
+ * Linux 5.12 or later.
+ */
+#include "arducam.h"
+#include <linux/clk-provider.h>
+#include <linux/clkdev.h>
+#include <linux/i2c.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/property.h>
+#include <linux/version.h>
+#include <media/v4l2-ctrls.h>
+#include <media/v4l2-device.h>
+#include <media/v4l2-subdev.h>
+#include <asm/unaligned.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
+#error "arducam_sim needs software node graph support (Linux 5.12)"
+#endif
+
+#define SIM_ADDR		0x0c
+#define SIM_XCLK_FREQ		24000000
+#define SIM_MAX_FORMATS		8
+#define SIM_MAX_RESOLUTIONS	16
+
+static unsigned int sensor_id = 0x0519;
+module_param(sensor_id, uint, 0444);
+MODULE_PARM_DESC(sensor_id, "Value of SENSOR_ID_REG");
+
+static unsigned int fw_version = 0x0001;
+module_param(fw_version, uint, 0444);
+MODULE_PARM_DESC(fw_version, "Value of DEVICE_VERSION_REG");
+
+static unsigned int data_types[SIM_MAX_FORMATS] = { IMAGE_DT_RAW10 };
+static int num_data_types = 1;
+module_param_array(data_types, uint, &num_data_types, 0444);
+MODULE_PARM_DESC(data_types, "CSI-2 data type of each pixel format");
+
+static unsigned int bayer_order = BAYER_ORDER_BGGR;
+module_param(bayer_order, uint, 0444);
+MODULE_PARM_DESC(bayer_order, "Bayer order reported for every pixel format");
+
+static unsigned int resolutions[2 * SIM_MAX_RESOLUTIONS] = {
+	4656, 3496,
+	1920, 1080,
+	1280, 720,
+};
+static int num_resolutions = 6;
+module_param_array(resolutions, uint, &num_resolutions, 0444);
+MODULE_PARM_DESC(resolutions, "width,height pairs offered by every pixel format");
+
+static unsigned int lanes = 2;
+module_param(lanes, uint, 0444);
+MODULE_PARM_DESC(lanes, "Number of CSI-2 data lanes (1, 2 or 4)");
+
+static unsigned int max_ctrls = UINT_MAX;
+module_param(max_ctrls, uint, 0444);
+MODULE_PARM_DESC(max_ctrls, "Only expose the first max_ctrls controls");
+
+static unsigned int idle_us = 1000;
+module_param(idle_us, uint, 0644);
+MODULE_PARM_DESC(idle_us, "Time SYSTEM_IDLE_REG stays busy after a mode, control or stream change");
+
+static unsigned int nak_every;
+module_param(nak_every, uint, 0644);
+MODULE_PARM_DESC(nak_every, "Fail every n-th transfer, 0 never");
+
+struct sim_ctrl {
+	u32 id;
+	u32 min;
+	u32 max;
+	u32 step;
+	u32 def;
+	u32 val;
+};
+
+static const struct sim_ctrl sim_default_ctrls[] = {
+	{ V4L2_CID_ARDUCAM_FRAME_RATE, 1, 60, 1, 30 },
+	{ V4L2_CID_EXPOSURE, 4, 65535, 1, 1000 },
+	{ V4L2_CID_ANALOGUE_GAIN, 100, 1600, 1, 100 },
+	{ V4L2_CID_HFLIP, 0, 1, 1, 0 },
+	{ V4L2_CID_VFLIP, 0, 1, 1, 0 },
+	{ V4L2_CID_HBLANK, 0, 0xffff, 1, 0 },
+	{ V4L2_CID_VBLANK, 4, 0xffff, 1, 100 },
+	{ V4L2_CID_PIXEL_RATE, 1, 0x7fffffff, 1, 200000000 },
+};
+
+struct arducam_sim {
+	struct i2c_adapter adap;
+	struct i2c_client *client;
+	struct clk_hw *xclk;
+	struct clk_lookup *xclk_lookup;
+	struct v4l2_device v4l2_dev;
+
+	/* Bridge state */
+	u32 stream_on;
+	u32 pixformat_index;
+	u32 resolution_index;
+	int ctrl_sel;
+	u32 sel_target;
+	bool hold;
+	u32 apply_frame;
+	ktime_t busy_until;
+	ktime_t stream_start;
+	struct sim_ctrl ctrls[ARRAY_SIZE(sim_default_ctrls)];
+	unsigned int num_ctrls;
+
+	/* Traffic as the bridge sees it, whatever the driver build */
+	unsigned int xfers;
+	unsigned int regs;
+};
+
+static struct arducam_sim sim;
+
+module_param_named(xfers, sim.xfers, uint, 0644);
+MODULE_PARM_DESC(xfers, "I2C transfers served, write 0 to reset");
+module_param_named(regs, sim.regs, uint, 0644);
+MODULE_PARM_DESC(regs, "Registers read or written, write 0 to reset");
+
+static u32 sim_data_lanes[4] = { 1, 2, 3, 4 };
+static struct property_entry sim_ep_props[2];
+
+static struct software_node sim_nodes[] = {
+	{ .name = "arducam-sim" },
+	{ .name = "port@0", .parent = &sim_nodes[0] },
+	{ .name = "endpoint@0", .parent = &sim_nodes[1],
+	  .properties = sim_ep_props },
+	{ }
+};
+
+static void sim_set_busy(struct arducam_sim *sim)
+{
+	sim->busy_until = ktime_add_us(ktime_get(), idle_us);
+}
+
+static u32 sim_frame_count(struct arducam_sim *sim)
+{
+	u32 fps = sim->ctrls[0].val ? sim->ctrls[0].val : 30;
+
+	if (!sim->stream_on)
+		return 0;
+
+	return div_u64(ktime_us_delta(ktime_get(), sim->stream_start) * fps,
+		       USEC_PER_SEC);
+}
+
+static struct sim_ctrl *sim_selected_ctrl(struct arducam_sim *sim)
+{
+	return sim->ctrl_sel >= 0 ? &sim->ctrls[sim->ctrl_sel] : NULL;
+}
+
+static u32 sim_read(struct arducam_sim *sim, u16 reg)
+{
+	struct sim_ctrl *ctrl = sim_selected_ctrl(sim);
+	u32 pix = sim->pixformat_index;
+	u32 res = sim->resolution_index;
+
+	switch (reg) {
+	case STREAM_ON:
+		return sim->stream_on;
+	case DEVICE_VERSION_REG:
+		return fw_version;
+	case SENSOR_ID_REG:
+		return sensor_id;
+	case DEVICE_ID_REG:
+		return DEVICE_ID;
+	case SYSTEM_IDLE_REG:
+		return ktime_before(ktime_get(), sim->busy_until);
+	case FRAME_COUNT_REG:
+		return sim_frame_count(sim);
+	case METADATA_WIDTH_REG:
+		/* One embedded line as wide as the image, in bytes */
+		if (2 * res + 1 >= num_resolutions)
+			return NO_DATA_AVAILABLE;
+		return max_t(u32, resolutions[2 * res],
+			     sizeof(struct arducam_frame_meta));
+	case METADATA_LINES_REG:
+		return 1;
+
+	case PIXFORMAT_INDEX_REG:
+		return pix;
+	case PIXFORMAT_TYPE_REG:
+		return pix < num_data_types ? data_types[pix] : NO_DATA_AVAILABLE;
+	case PIXFORMAT_ORDER_REG:
+		return pix < num_data_types ? bayer_order : NO_DATA_AVAILABLE;
+	case MIPI_LANES_REG:
+		return pix < num_data_types ? lanes : NO_DATA_AVAILABLE;
+	case FLIPS_DONT_CHANGE_ORDER_REG:
+		return 0;
+
+	case RESOLUTION_INDEX_REG:
+		return res;
+	case FORMAT_WIDTH_REG:
+	case FORMAT_HEIGHT_REG:
+		if (2 * res + 1 >= num_resolutions)
+			return NO_DATA_AVAILABLE;
+		return resolutions[2 * res + (reg == FORMAT_HEIGHT_REG)];
+
+	case CTRL_ID_REG:
+		return ctrl ? ctrl->id : NO_DATA_AVAILABLE;
+	case CTRL_MIN_REG:
+		return ctrl ? ctrl->min : NO_DATA_AVAILABLE;
+	case CTRL_MAX_REG:
+		return ctrl ? ctrl->max : NO_DATA_AVAILABLE;
+	case CTRL_STEP_REG:
+		return ctrl ? ctrl->step : NO_DATA_AVAILABLE;
+	case CTRL_DEF_REG:
+		return ctrl ? ctrl->def : NO_DATA_AVAILABLE;
+	case CTRL_VALUE_REG:
+		return ctrl ? ctrl->val : NO_DATA_AVAILABLE;
+	case CTRL_HOLD_REG:
+		return sim->hold;
+	case CTRL_APPLY_FRAME_REG:
+		return sim->apply_frame;
+
+	case IPC_SEL_TARGET_REG:
+		return sim->sel_target;
+	case IPC_SEL_TOP_REG:
+	case IPC_SEL_LEFT_REG:
+	case IPC_DELAY_REG:
+		return 0;
+	case IPC_SEL_WIDTH_REG:
+	case IPC_SEL_HEIGHT_REG:
+		if (2 * res + 1 >= num_resolutions)
+			return NO_DATA_AVAILABLE;
+		return resolutions[2 * res + (reg == IPC_SEL_HEIGHT_REG)];
+
+	default:
+		return NO_DATA_AVAILABLE;
+	}
+}
+
+static void sim_write(struct arducam_sim *sim, u16 reg, u32 val)
+{
+	struct sim_ctrl *ctrl;
+	int i;
+
+	switch (reg) {
+	case STREAM_ON:
+		if (val && !sim->stream_on)
+			sim->stream_start = ktime_get();
+		sim->stream_on = val;
+		sim_set_busy(sim);
+		break;
+
+	case PIXFORMAT_INDEX_REG:
+		sim->pixformat_index = val;
+		break;
+	case RESOLUTION_INDEX_REG:
+		sim->resolution_index = val;
+		sim_set_busy(sim);
+		break;
+
+	case CTRL_INDEX_REG:
+		sim->ctrl_sel = val < sim->num_ctrls ? val : -1;
+		break;
+	case CTRL_ID_REG:
+		sim->ctrl_sel = -1;
+		for (i = 0; i < sim->num_ctrls; i++)
+			if (sim->ctrls[i].id == val)
+				sim->ctrl_sel = i;
+		break;
+	case CTRL_VALUE_REG:
+		ctrl = sim_selected_ctrl(sim);
+		if (ctrl)
+			ctrl->val = clamp_t(s32, val, ctrl->min, ctrl->max);
+		sim_set_busy(sim);
+		break;
+	case CTRL_HOLD_REG:
+		/* Staged values land together on the next frame */
+		if (sim->hold && !val)
+			sim->apply_frame = sim_frame_count(sim) + 1;
+		sim->hold = val;
+		break;
+
+	case IPC_SEL_TARGET_REG:
+		sim->sel_target = val;
+		sim_set_busy(sim);
+		break;
+	}
+}
+
+static int sim_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs, int num)
+{
+	struct arducam_sim *sim = i2c_get_adapdata(adap);
+	u16 reg = 0;
+	int i, m;
+
+	sim->xfers++;
+	if (nak_every && sim->xfers % nak_every == 0)
+		return -EREMOTEIO;
+
+	for (m = 0; m < num; m++) {
+		struct i2c_msg *msg = &msgs[m];
+
+		if (msg->addr != SIM_ADDR)
+			return -ENXIO;
+
+		if (msg->flags & I2C_M_RD) {
+			for (i = 0; i + 4 <= msg->len; i += 4, sim->regs++)
+				put_unaligned_be32(sim_read(sim, reg++),
+						   msg->buf + i);
+			continue;
+		}
+
+		if (msg->len < 2)
+			return -EINVAL;
+
+		reg = get_unaligned_be16(msg->buf);
+		for (i = 2; i + 4 <= msg->len; i += 4, sim->regs++)
+			sim_write(sim, reg++, get_unaligned_be32(msg->buf + i));
+	}
+
+	return num;
+}
+
+/* Stand in for the receiver: give the bound sensor its subdev node */
+static int sim_register_nodes(struct arducam_sim *sim)
+{
+	struct v4l2_subdev *sd = NULL;
+	int ret;
+
+	/* Bound in i2c_new_client_device() when arducam.ko is loaded */
+	if (sim->client->dev.driver)
+		sd = i2c_get_clientdata(sim->client);
+	if (!sd) {
+		pr_err("arducam_sim: arducam-pivariety did not bind\n");
+		return -ENODEV;
+	}
+
+	strscpy(sim->v4l2_dev.name, "arducam-sim", sizeof(sim->v4l2_dev.name));
+	ret = v4l2_device_register(NULL, &sim->v4l2_dev);
+	if (ret)
+		return ret;
+
+	ret = v4l2_device_register_subdev(&sim->v4l2_dev, sd);
+	if (!ret)
+		ret = v4l2_device_register_subdev_nodes(&sim->v4l2_dev);
+	if (ret)
+		v4l2_device_unregister(&sim->v4l2_dev);
+
+	return ret;
+}
+
+static u32 sim_functionality(struct i2c_adapter *adap)
+{
+	return I2C_FUNC_I2C;
+}
+
+static const struct i2c_algorithm sim_algo = {
+	.master_xfer = sim_xfer,
+	.functionality = sim_functionality,
+};
+
+static int __init arducam_sim_init(void)
+{
+	struct i2c_board_info info = {
+		I2C_BOARD_INFO("arducam-pivariety", SIM_ADDR),
+	};
+	int i, ret;
+
+	if (lanes != 1 && lanes != 2 && lanes != 4)
+		return -EINVAL;
+
+	sim.num_ctrls = min_t(unsigned int, max_ctrls,
+			      ARRAY_SIZE(sim_default_ctrls));
+	for (i = 0; i < sim.num_ctrls; i++) {
+		sim.ctrls[i] = sim_default_ctrls[i];
+		sim.ctrls[i].val = sim.ctrls[i].def;
+	}
+	sim.ctrl_sel = -1;
+
+	sim_ep_props[0] = PROPERTY_ENTRY_U32_ARRAY_LEN("data-lanes",
+						       sim_data_lanes, lanes);
+	ret = software_node_register_nodes(sim_nodes);
+	if (ret)
+		return ret;
+
+	sim.adap.owner = THIS_MODULE;
+	sim.adap.algo = &sim_algo;
+	strscpy(sim.adap.name, "Arducam Pivariety simulator",
+		sizeof(sim.adap.name));
+	i2c_set_adapdata(&sim.adap, &sim);
+	ret = i2c_add_adapter(&sim.adap);
+	if (ret)
+		goto err_nodes;
+
+	/* The driver asks for a 24 MHz "xclk" */
+	sim.xclk = clk_hw_register_fixed_rate(NULL, "arducam-sim-xclk", NULL,
+					      0, SIM_XCLK_FREQ);
+	if (IS_ERR(sim.xclk)) {
+		ret = PTR_ERR(sim.xclk);
+		goto err_adapter;
+	}
+
+	sim.xclk_lookup = clkdev_hw_create(sim.xclk, "xclk", "%d-%04x",
+					   i2c_adapter_id(&sim.adap), SIM_ADDR);
+	if (!sim.xclk_lookup) {
+		ret = -ENOMEM;
+		goto err_clk;
+	}
+
+	info.fwnode = software_node_fwnode(&sim_nodes[0]);
+	sim.client = i2c_new_client_device(&sim.adap, &info);
+	if (IS_ERR(sim.client)) {
+		ret = PTR_ERR(sim.client);
+		goto err_lookup;
+	}
+
+	ret = sim_register_nodes(&sim);
+	if (ret)
+		goto err_client;
+
+	return 0;
+
+err_client:
+	i2c_unregister_device(sim.client);
+err_lookup:
+	clkdev_drop(sim.xclk_lookup);
+err_clk:
+	clk_hw_unregister_fixed_rate(sim.xclk);
+err_adapter:
+	i2c_del_adapter(&sim.adap);
+err_nodes:
+	software_node_unregister_nodes(sim_nodes);
+
+	return ret;
+}
+
+static void __exit arducam_sim_exit(void)
+{
+	v4l2_device_unregister(&sim.v4l2_dev);
+	i2c_unregister_device(sim.client);
+	clkdev_drop(sim.xclk_lookup);
+	clk_hw_unregister_fixed_rate(sim.xclk);
+	i2c_del_adapter(&sim.adap);
+	software_node_unregister_nodes(sim_nodes);
+}
+
+module_init(arducam_sim_init);
+module_exit(arducam_sim_exit);
+
+MODULE_AUTHOR("Arducam <www.arducam.com>");
+MODULE_DESCRIPTION("Arducam Pivariety bridge simulator");
+MODULE_LICENSE("GPL v2");
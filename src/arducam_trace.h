@@ -0,0 +1,190 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints for the Arducam Pivariety driver
+ * Copyright (C) 2021, Arducam
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM arducam
+
+#if !defined(_ARDUCAM_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _ARDUCAM_TRACE_H_
+
+#include <linux/i2c.h>
+#include <linux/tracepoint.h>
+
+/* One register transaction: count registers starting at addr */
+DECLARE_EVENT_CLASS(arducam_reg,
+	TP_PROTO(struct i2c_client *client, u16 addr, u32 val, int count,
+		 int retries, s64 duration_ns, int ret),
+	TP_ARGS(client, addr, val, count, retries, duration_ns, ret),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&client->dev))
+		__field(u16, addr)
+		__field(u32, val)
+		__field(int, count)
+		__field(int, retries)
+		__field(s64, duration_ns)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(&client->dev));
+		__entry->addr = addr;
+		__entry->val = val;
+		__entry->count = count;
+		__entry->retries = retries;
+		__entry->duration_ns = duration_ns;
+		__entry->ret = ret;
+	),
+	TP_printk("%s reg=0x%04x val=0x%08x count=%d retries=%d duration=%lldns ret=%d",
+		  __get_str(dev), __entry->addr, __entry->val, __entry->count,
+		  __entry->retries, __entry->duration_ns, __entry->ret)
+);
+
+DEFINE_EVENT(arducam_reg, arducam_read,
+	TP_PROTO(struct i2c_client *client, u16 addr, u32 val, int count,
+		 int retries, s64 duration_ns, int ret),
+	TP_ARGS(client, addr, val, count, retries, duration_ns, ret)
+);
+
+DEFINE_EVENT(arducam_reg, arducam_write,
+	TP_PROTO(struct i2c_client *client, u16 addr, u32 val, int count,
+		 int retries, s64 duration_ns, int ret),
+	TP_ARGS(client, addr, val, count, retries, duration_ns, ret)
+);
+
+TRACE_EVENT(arducam_wait_enter,
+	TP_PROTO(struct i2c_client *client, int interval),
+	TP_ARGS(client, interval),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&client->dev))
+		__field(int, interval)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(&client->dev));
+		__entry->interval = interval;
+	),
+	TP_printk("%s interval=%dms", __get_str(dev), __entry->interval)
+);
+
+TRACE_EVENT(arducam_wait_exit,
+	TP_PROTO(struct i2c_client *client, u32 polls, u32 us, bool timed_out),
+	TP_ARGS(client, polls, us, timed_out),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&client->dev))
+		__field(u32, polls)
+		__field(u32, us)
+		__field(bool, timed_out)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(&client->dev));
+		__entry->polls = polls;
+		__entry->us = us;
+		__entry->timed_out = timed_out;
+	),
+	TP_printk("%s polls=%u duration=%uus%s", __get_str(dev),
+		  __entry->polls, __entry->us,
+		  __entry->timed_out ? " timeout" : "")
+);
+
+#ifndef _ARDUCAM_TRACE_CTRL_PATH_
+#define _ARDUCAM_TRACE_CTRL_PATH_
+/* What arducam_s_ctrl() did with a control write */
+enum arducam_ctrl_path {
+	ARDUCAM_CTRL_WRITTEN,
+	ARDUCAM_CTRL_BATCHED,
+	ARDUCAM_CTRL_QUEUED,
+	ARDUCAM_CTRL_SKIPPED,	/* the bridge already holds the value */
+};
+#endif
+
+/* Export the values so user space can resolve __print_symbolic() */
+TRACE_DEFINE_ENUM(ARDUCAM_CTRL_WRITTEN);
+TRACE_DEFINE_ENUM(ARDUCAM_CTRL_BATCHED);
+TRACE_DEFINE_ENUM(ARDUCAM_CTRL_QUEUED);
+TRACE_DEFINE_ENUM(ARDUCAM_CTRL_SKIPPED);
+
+TRACE_EVENT(arducam_s_ctrl,
+	TP_PROTO(struct i2c_client *client, u32 id, s32 val, int how),
+	TP_ARGS(client, id, val, how),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&client->dev))
+		__field(u32, id)
+		__field(s32, val)
+		__field(int, how)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(&client->dev));
+		__entry->id = id;
+		__entry->val = val;
+		__entry->how = how;
+	),
+	TP_printk("%s id=0x%08x val=%d %s", __get_str(dev),
+		  __entry->id, __entry->val,
+		  __print_symbolic(__entry->how,
+				   { ARDUCAM_CTRL_WRITTEN, "written" },
+				   { ARDUCAM_CTRL_BATCHED, "batched" },
+				   { ARDUCAM_CTRL_QUEUED, "queued" },
+				   { ARDUCAM_CTRL_SKIPPED, "skipped" }))
+);
+
+TRACE_EVENT(arducam_set_fmt,
+	TP_PROTO(struct i2c_client *client, u32 code, u32 width, u32 height,
+		 int format_idx, int resolution_idx),
+	TP_ARGS(client, code, width, height, format_idx, resolution_idx),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&client->dev))
+		__field(u32, code)
+		__field(u32, width)
+		__field(u32, height)
+		__field(int, format_idx)
+		__field(int, resolution_idx)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(&client->dev));
+		__entry->code = code;
+		__entry->width = width;
+		__entry->height = height;
+		__entry->format_idx = format_idx;
+		__entry->resolution_idx = resolution_idx;
+	),
+	TP_printk("%s code=0x%04x %ux%u format=%d resolution=%d",
+		  __get_str(dev), __entry->code, __entry->width,
+		  __entry->height, __entry->format_idx,
+		  __entry->resolution_idx)
+);
+
+DECLARE_EVENT_CLASS(arducam_onoff,
+	TP_PROTO(struct i2c_client *client, bool on, int ret),
+	TP_ARGS(client, on, ret),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&client->dev))
+		__field(bool, on)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(&client->dev));
+		__entry->on = on;
+		__entry->ret = ret;
+	),
+	TP_printk("%s %s ret=%d", __get_str(dev),
+		  __entry->on ? "on" : "off", __entry->ret)
+);
+
+DEFINE_EVENT(arducam_onoff, arducam_stream,
+	TP_PROTO(struct i2c_client *client, bool on, int ret),
+	TP_ARGS(client, on, ret)
+);
+
+DEFINE_EVENT(arducam_onoff, arducam_power,
+	TP_PROTO(struct i2c_client *client, bool on, int ret),
+	TP_ARGS(client, on, ret)
+);
+
+#endif /* _ARDUCAM_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE arducam_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,237 @@
+#!/usr/bin/env python3
+# -*- coding: UTF-8 -*-
+#
+# Bridge traffic regression harness for the Pivariety driver.
+#
+# Loads arducam.ko and arducam_sim.ko (make ARDUCAM_SIM=y), runs every
+# subdev ioctl path with v4l2-ctl and reads the I2C transfers and registers
+# of the path as the simulated bridge counted them ("bridge"), and per call
+# from the driver's debugfs ops file where the driver has one. The counts
+# are compared with a recorded baseline; CPU time per call is reported but
+# not compared.
+#
+#   sudo python3 arducam_sim_bench.py --record    # write the baseline
+#   sudo python3 arducam_sim_bench.py             # compare with it
+#
+# The bridge counts do not depend on the driver build, so two builds can
+# be compared, e.g. before and after a change to the access paths:
+#
+#   sudo python3 arducam_sim_bench.py --record --driver old/arducam.ko \
+#           --baseline before.baseline
+#   sudo python3 arducam_sim_bench.py --baseline before.baseline
+#
+# Needs root, debugfs mounted on /sys/kernel/debug and v4l2-ctl.
+
+import argparse
+import glob
+import os
+import subprocess
+import sys
+
+TOOLS_DIR = os.path.dirname(os.path.abspath(__file__))
+SRC_DIR = os.path.join(TOOLS_DIR, "..", "src")
+BASELINE = os.path.join(TOOLS_DIR, "arducam_sim_bench.baseline")
+
+# The sim's default pixel format, RAW10 BGGR, and a mode it offers
+CODE = "0x3007"
+WIDTH = 1920
+HEIGHT = 1080
+
+# idle_us=0: idle polls are not timing dependent, so counts are exact
+SIM_PARAMS = ["idle_us=0", "resolutions=4656,3496,1920,1080,1280,720"]
+
+# Path name and the v4l2-ctl arguments that run it
+PATHS = [
+    ("enum_mbus_code", ["--list-subdev-mbus-codes", "0"]),
+    ("enum_frame_size",
+     ["--list-subdev-framesizes", "pad=0,code=%s" % CODE]),
+    ("get_fmt", ["--get-subdev-fmt", "0"]),
+    ("set_fmt",
+     ["--set-subdev-fmt",
+      "pad=0,width=%d,height=%d,code=%s" % (WIDTH, HEIGHT, CODE)]),
+    ("get_selection", ["--get-subdev-selection", "pad=0,target=crop"]),
+    ("enum_frame_interval",
+     ["--list-subdev-frameintervals",
+      "pad=0,width=%d,height=%d,code=%s" % (WIDTH, HEIGHT, CODE)]),
+    ("s_ctrl", ["--set-ctrl", "exposure=2000"]),
+]
+
+
+def Run(cmd):
+    return subprocess.run(cmd, check=True, stdout=subprocess.PIPE,
+                          stderr=subprocess.STDOUT, universal_newlines=True)
+
+
+SIM_PARAMS_DIR = "/sys/module/arducam_sim/parameters"
+
+
+def LoadModules(driver):
+    Run(["insmod", driver])
+    Run(["insmod", os.path.join(SRC_DIR, "arducam_sim.ko")] + SIM_PARAMS)
+
+
+def UnloadModules():
+    for module in ("arducam_sim", "arducam"):
+        subprocess.run(["rmmod", module], stderr=subprocess.DEVNULL)
+
+
+# None for driver builds without debugfs statistics
+def FindDebugfs():
+    dirs = glob.glob("/sys/kernel/debug/arducam-*")
+    if len(dirs) > 1:
+        sys.exit("expected one arducam debugfs directory, found %d" % len(dirs))
+    return dirs[0] if dirs else None
+
+
+def FindSubdev():
+    for name in glob.glob("/sys/class/video4linux/v4l-subdev*/name"):
+        with open(name) as f:
+            if "arducam" in f.read():
+                return "/dev/" + os.path.basename(os.path.dirname(name))
+    sys.exit("no arducam subdev node")
+
+
+# Totals per register block, from the stats file
+def ReadStats(debugfs):
+    blocks = {}
+    with open(os.path.join(debugfs, "stats")) as f:
+        for line in f:
+            fields = line.split()
+            if not fields or line.startswith("#") or fields[0] == "block":
+                continue
+            # The histograms that follow repeat the block names
+            if len(fields) != 6 or fields[0] in blocks:
+                break
+            blocks[fields[0]] = {"xfers": int(fields[1]) + int(fields[2]),
+                                 "regs": int(fields[3])}
+    return blocks
+
+
+# Per call averages of every op, from the ops file
+def ReadOps(debugfs):
+    ops = {}
+    with open(os.path.join(debugfs, "ops")) as f:
+        next(f)
+        for line in f:
+            op, calls, xfers, regs, avg_us, busy_us, max_us = line.split()
+            ops[op] = {"calls": int(calls), "xfers": int(xfers),
+                       "regs": int(regs), "busy_us": int(busy_us)}
+    return ops
+
+
+# Transfers and registers the simulated bridge has served
+def ReadBridge():
+    counts = {}
+    for name in ("xfers", "regs"):
+        with open(os.path.join(SIM_PARAMS_DIR, name)) as f:
+            counts[name] = int(f.read())
+    return counts
+
+
+def Reset(debugfs):
+    for name in ("xfers", "regs"):
+        with open(os.path.join(SIM_PARAMS_DIR, name), "w") as f:
+            f.write("0")
+    if debugfs:
+        with open(os.path.join(debugfs, "reset"), "w") as f:
+            f.write("1")
+
+
+def Measure():
+    results = {}
+    debugfs = FindDebugfs()
+
+    # Nothing has been reset since load: the totals are the probe
+    results[("probe", "bridge")] = ReadBridge()
+    if debugfs:
+        for block, counts in ReadStats(debugfs).items():
+            results[("probe", block)] = counts
+
+    subdev = FindSubdev()
+    for path, args in PATHS:
+        Reset(debugfs)
+        Run(["v4l2-ctl", "-d", subdev] + args)
+        results[(path, "bridge")] = ReadBridge()
+        if debugfs:
+            for op, counts in ReadOps(debugfs).items():
+                results[(path, op)] = counts
+
+    return results
+
+
+def ReadBaseline(name):
+    baseline = {}
+    with open(name) as f:
+        for line in f:
+            if line.startswith("#") or not line.strip():
+                continue
+            path, op, xfers, regs = line.split()
+            baseline[(path, op)] = {"xfers": int(xfers), "regs": int(regs)}
+    return baseline
+
+
+def WriteBaseline(name, results):
+    with open(name, "w") as f:
+        f.write("# arducam_sim %s\n" % " ".join(SIM_PARAMS))
+        f.write("# path op xfers regs: bridge per path, ops per call, "
+                "probe per register block\n")
+        for (path, op), counts in sorted(results.items()):
+            f.write("%s %s %d %d\n" % (path, op, counts["xfers"],
+                                       counts["regs"]))
+
+
+def Compare(results, baseline):
+    failed = False
+
+    print("%-20s %-20s %14s %14s %8s" % ("path", "op", "xfers", "regs",
+                                         "busy_us"))
+    for key in sorted(set(results) | set(baseline)):
+        now = results.get(key)
+        then = baseline.get(key)
+        # Builds with and without debugfs statistics only share "bridge"
+        if not now or not then:
+            print("%-20s %-20s %s" % (key[0], key[1],
+                                      "new" if now else "missing"))
+            continue
+
+        regressed = now["xfers"] > then["xfers"] or now["regs"] > then["regs"]
+        failed |= regressed
+        print("%-20s %-20s %6d -> %-5d %6d -> %-5d %8s%s" % (
+            key[0], key[1], then["xfers"], now["xfers"], then["regs"],
+            now["regs"], now.get("busy_us", "-"),
+            "  REGRESSED" if regressed else ""))
+
+    return failed
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Compare the driver's bridge traffic with a baseline")
+    parser.add_argument("--record", action="store_true",
+                        help="write the baseline instead of comparing")
+    parser.add_argument("--baseline", default=BASELINE,
+                        help="baseline file (default: %(default)s)")
+    parser.add_argument("--driver", default=os.path.join(SRC_DIR, "arducam.ko"),
+                        help="driver module to measure (default: %(default)s)")
+    args = parser.parse_args()
+
+    if not args.record and not os.path.exists(args.baseline):
+        sys.exit("no baseline, record one with --record")
+
+    UnloadModules()
+    LoadModules(args.driver)
+    try:
+        results = Measure()
+    finally:
+        UnloadModules()
+
+    if args.record:
+        WriteBaseline(args.baseline, results)
+        print("baseline written to %s" % args.baseline)
+        return 0
+
+    return 1 if Compare(results, ReadBaseline(args.baseline)) else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())